@@ -0,0 +1,201 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+
+#include "binary.h"
+#include "log.h"
+
+using namespace rhost::log;
+
+namespace rhost {
+    namespace binary {
+        namespace {
+            const uint8_t logical_na = 0xFF;
+            const int32_t string_na = -1;
+
+            void binary_error(SEXP sexp, const char* format, ...) {
+                SEXP repr_sexp = STRING_ELT(Rf_deparse1line(sexp, R_FALSE), 0);
+                Rf_protect(repr_sexp);
+                const char* repr = R_CHAR(repr_sexp);
+
+                char buf[0x10000] = {};
+                snprintf(buf, sizeof buf, "Binary serialization failed for input:\n\n%s\n\n", repr);
+
+                size_t len = strlen(buf);
+                va_list va;
+                va_start(va, format);
+                vsnprintf(buf + len, sizeof buf - len, format, va);
+                va_end(va);
+
+                Rf_error("%s", buf);
+            }
+
+            template <class T>
+            void append(std::string& result, T value) {
+                boost::endian::native_to_little_inplace(value);
+                result.append(reinterpret_cast<const char*>(&value), sizeof value);
+            }
+
+            void append(std::string& result, double value) {
+                uint64_t bits;
+                memcpy(&bits, &value, sizeof bits);
+                append(result, bits);
+            }
+
+            // Appends an array of elements; on little-endian platforms, this is a single copy.
+            template <class T>
+            void append_array(std::string& result, const T* data, size_t count) {
+                if (boost::endian::order::native == boost::endian::order::little) {
+                    result.append(reinterpret_cast<const char*>(data), count * sizeof(T));
+                } else {
+                    for (size_t i = 0; i < count; ++i) {
+                        append(result, data[i]);
+                    }
+                }
+            }
+
+            void append_header(std::string& result, SEXP sexp, value_type type, R_xlen_t count) {
+                if (static_cast<uint64_t>(count) > std::numeric_limits<uint32_t>::max()) {
+                    binary_error(sexp, "Vector is too long.");
+                }
+
+                result.push_back(static_cast<char>(type));
+                append(result, static_cast<uint32_t>(count));
+            }
+
+            void append_string(std::string& result, SEXP sexp, SEXP charsxp) {
+                if (charsxp == R_NaString) {
+                    append(result, string_na);
+                    return;
+                }
+
+                const void* vmax = vmaxget();
+                const char* s = Rf_translateCharUTF8(charsxp);
+                if (!s) {
+                    vmaxset(vmax);
+                    binary_error(sexp, "String could not be converted to UTF-8.");
+                }
+
+                size_t len = strlen(s);
+                append(result, static_cast<int32_t>(len));
+                result.append(s, len);
+                vmaxset(vmax);
+            }
+
+            void logical_to_binary(SEXP sexp, std::string& result) {
+                R_xlen_t count = Rf_xlength(sexp);
+                append_header(result, sexp, value_type::logical, count);
+
+                const int* data = LOGICAL(sexp);
+                size_t start = result.size();
+                result.resize(start + count);
+                for (R_xlen_t i = 0; i < count; ++i) {
+                    int x = data[i];
+                    result[start + i] = static_cast<char>(x == R_NaInt ? logical_na : (x != 0));
+                }
+            }
+
+            void list_to_binary(SEXP sexp, std::string& result) {
+                R_xlen_t count = Rf_xlength(sexp);
+                SEXP names = Rf_getAttrib(sexp, R_NamesSymbol);
+
+                if (Rf_isNull(names)) {
+                    append_header(result, sexp, value_type::list, count);
+                    for (R_xlen_t i = 0; i < count; ++i) {
+                        to_binary(VECTOR_ELT(sexp, i), result);
+                    }
+                } else {
+                    Rf_protect(names);
+                    if (Rf_xlength(names) != count) {
+                        binary_error(sexp, "There are fewer names than elements in list.");
+                    }
+
+                    append_header(result, sexp, value_type::named_list, count);
+                    for (R_xlen_t i = 0; i < count; ++i) {
+                        append_string(result, sexp, STRING_ELT(names, i));
+                        to_binary(VECTOR_ELT(sexp, i), result);
+                    }
+                    Rf_unprotect(1);
+                }
+            }
+
+            void env_to_binary(SEXP sexp, std::string& result) {
+                SEXP names = Rf_protect(R_lsInternal3(sexp, R_TRUE, R_FALSE));
+                R_xlen_t count = Rf_xlength(names);
+
+                append_header(result, sexp, value_type::named_list, count);
+                for (R_xlen_t i = 0; i < count; ++i) {
+                    SEXP name_sexp = STRING_ELT(names, i);
+                    append_string(result, sexp, name_sexp);
+                    to_binary(Rf_findVar(Rf_installChar(name_sexp), sexp), result);
+                }
+
+                Rf_unprotect(1);
+            }
+        }
+
+        void to_binary(SEXP sexp, std::string& result) {
+            switch (TYPEOF(sexp)) {
+            case NILSXP:
+                result.push_back(static_cast<char>(value_type::null));
+                break;
+
+            case LGLSXP:
+                logical_to_binary(sexp, result);
+                break;
+
+            case INTSXP: {
+                R_xlen_t count = Rf_xlength(sexp);
+                append_header(result, sexp, value_type::integer, count);
+                append_array(result, INTEGER(sexp), count);
+                break;
+            }
+
+            case REALSXP: {
+                R_xlen_t count = Rf_xlength(sexp);
+                append_header(result, sexp, value_type::real, count);
+                append_array(result, REAL(sexp), count);
+                break;
+            }
+
+            case STRSXP: {
+                R_xlen_t count = Rf_xlength(sexp);
+                append_header(result, sexp, value_type::string, count);
+                for (R_xlen_t i = 0; i < count; ++i) {
+                    append_string(result, sexp, STRING_ELT(sexp, i));
+                }
+                break;
+            }
+
+            case VECSXP:
+                list_to_binary(sexp, result);
+                break;
+
+            case ENVSXP:
+                env_to_binary(sexp, result);
+                break;
+
+            default:
+                binary_error(sexp, "Unsupported type - must be one of: NULL; logical, integer, real, character vector; list; environment.");
+            }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+#pragma once
+#include "stdafx.h"
+#include "util.h"
+
+namespace rhost {
+    namespace binary {
+        // Compact binary encoding of R values, used instead of JSON for eval results when requested by the
+        // client (see the 'b' flag in handle_eval). It is considerably cheaper to produce and to consume
+        // than JSON for large vectors and lists. All numbers are little-endian. A value is a type tag byte,
+        // followed by a uint32 element count, followed by the elements:
+        //
+        // NULL        - tag 0, no count and no elements
+        // logical     - tag 1, count bytes: 0 for FALSE, 1 for TRUE, 0xFF for NA
+        // integer     - tag 2, count int32 values; NA is INT32_MIN
+        // double      - tag 3, count IEEE 754 doubles; NA, NaN and infinities are preserved as is
+        // character   - tag 4, count strings
+        // list        - tag 5, count values (recursively)
+        // named list  - tag 6, count pairs of string name followed by value (recursively)
+        //
+        // Strings are an int32 byte length, followed by that many bytes of UTF-8 (no terminator).
+        // NA is represented as length -1. Environments are encoded as named lists. Attributes other
+        // than names are not encoded. Any other type is considered invalid.
+        enum class value_type : uint8_t {
+            null = 0,
+            logical = 1,
+            integer = 2,
+            real = 3,
+            string = 4,
+            list = 5,
+            named_list = 6,
+        };
+
+        // Appends the encoding of sexp to the end of result. Errors are reported via Rf_error.
+        void to_binary(SEXP sexp, std::string& result);
+    }
+}
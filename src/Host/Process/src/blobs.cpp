@@ -22,7 +22,6 @@
 
 #include "blobs.h"
 #include "log.h"
-#include "host.h"
 
 using namespace rhost::util;
 using namespace rhost::log;
@@ -67,6 +66,447 @@ namespace rhost {
             }
         }
 
+        namespace {
+            const size_t shard_count = 16;
+            const size_t min_chunk_capacity = 0x1000;
+
+            std::atomic<size_t> memory_limit;
+            std::atomic<size_t> resident_bytes, spilled_bytes, spill_count;
+
+            // Writes the data produced by for_each_segment to a new temporary file, and maps that file into
+            // memory. The file is deleted once the mapping is released. Returns nullptr on failure.
+            template <class F>
+            std::shared_ptr<char> map_temp_file(size_t size, F for_each_segment) {
+                auto path = fs::temp_directory_path() / fs::unique_path("rhost-blob-%%%%-%%%%-%%%%-%%%%");
+
+#ifdef _WIN32
+                HANDLE file = CreateFileW(path.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_NEW,
+                    FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+                if (file == INVALID_HANDLE_VALUE) {
+                    logf(log_verbosity::minimal, "Failed to create blob spill file %s: %u\n", path.string().c_str(), GetLastError());
+                    return nullptr;
+                }
+                SCOPE_WARDEN(close_file, { CloseHandle(file); });
+
+                bool ok = true;
+                for_each_segment([&](const char* data, size_t n) {
+                    DWORD written;
+                    ok = ok && WriteFile(file, data, static_cast<DWORD>(n), &written, nullptr) && written == n;
+                });
+                if (!ok) {
+                    logf(log_verbosity::minimal, "Failed to write blob spill file %s: %u\n", path.string().c_str(), GetLastError());
+                    return nullptr;
+                }
+
+                // The mapping holds on to the file, so it's safe to close both handles once the view is mapped.
+                HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (!mapping) {
+                    logf(log_verbosity::minimal, "Failed to map blob spill file %s: %u\n", path.string().c_str(), GetLastError());
+                    return nullptr;
+                }
+                SCOPE_WARDEN(close_mapping, { CloseHandle(mapping); });
+
+                void* p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+                if (!p) {
+                    logf(log_verbosity::minimal, "Failed to map blob spill file %s: %u\n", path.string().c_str(), GetLastError());
+                    return nullptr;
+                }
+
+                spilled_bytes += size;
+                return std::shared_ptr<char>(static_cast<char*>(p), [size](char* p) {
+                    UnmapViewOfFile(p);
+                    spilled_bytes -= size;
+                });
+#else
+                int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+                if (fd == -1) {
+                    logf(log_verbosity::minimal, "Failed to create blob spill file %s: %s\n", path.c_str(), strerror(errno));
+                    return nullptr;
+                }
+                SCOPE_WARDEN(close_fd, { close(fd); });
+
+                // The file will stay around for as long as it's mapped.
+                unlink(path.c_str());
+
+                bool ok = true;
+                for_each_segment([&](const char* data, size_t n) {
+                    while (ok && n != 0) {
+                        ssize_t written = write(fd, data, n);
+                        if (written < 0) {
+                            ok = (errno == EINTR);
+                        } else {
+                            data += written;
+                            n -= written;
+                        }
+                    }
+                });
+                if (!ok) {
+                    logf(log_verbosity::minimal, "Failed to write blob spill file %s: %s\n", path.c_str(), strerror(errno));
+                    return nullptr;
+                }
+
+                void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED) {
+                    logf(log_verbosity::minimal, "Failed to map blob spill file %s: %s\n", path.c_str(), strerror(errno));
+                    return nullptr;
+                }
+
+                spilled_bytes += size;
+                return std::shared_ptr<char>(static_cast<char*>(p), [size](char* p) {
+                    munmap(p, size);
+                    spilled_bytes -= size;
+                });
+#endif
+            }
+        }
+
+        blob_chunk::blob_chunk(size_t capacity) :
+            data(nullptr), capacity(capacity), _memory(new char[capacity]) {
+            data = _memory.get();
+            resident_bytes += capacity;
+        }
+
+        blob_chunk::blob_chunk(std::shared_ptr<char> mapping, char* data, size_t capacity) :
+            data(data), capacity(capacity), _mapping(std::move(mapping)) {
+        }
+
+        blob_chunk::~blob_chunk() {
+            if (_memory) {
+                resident_bytes -= capacity;
+            }
+        }
+
+        class blob_store {
+        public:
+            blob_id create(const char* data, size_t size) {
+                blob_id id = ++_last_id;
+
+                // Check that it never overflows double mantissa, and provide immediate diagnostics if it happens.
+                if (id != blob_id(double(id))) {
+                    fatal_error("Blob ID overflow");
+                }
+
+                auto b = std::make_shared<stored_blob>();
+                write(*b, 0, data, size);
+
+                b->last_access = ++_clock;
+
+                auto& shard = shard_of(id);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                shard.blobs[id] = std::move(b);
+                ++_count;
+                return id;
+            }
+
+            void destroy(blob_id id) {
+                // If someone is still using the blob, it will be freed once they're done with it.
+                std::shared_ptr<stored_blob> b;
+                {
+                    auto& shard = shard_of(id);
+                    std::lock_guard<std::mutex> lock(shard.mutex);
+                    auto it = shard.blobs.find(id);
+                    if (it == shard.blobs.end()) {
+                        return;
+                    }
+                    b = std::move(it->second);
+                    shard.blobs.erase(it);
+                    --_count;
+                }
+
+                // Release the data right away - memory limit enforcement might still be holding on to the blob.
+                std::lock_guard<std::mutex> lock(b->mutex);
+                b->chunks.clear();
+                b->size = 0;
+            }
+
+            // Invokes f(stored_blob&) with the blob locked. Returns false if there's no such blob.
+            template <class F>
+            bool with_blob(blob_id id, F f) {
+                std::shared_ptr<stored_blob> b;
+                {
+                    auto& shard = shard_of(id);
+                    std::lock_guard<std::mutex> lock(shard.mutex);
+                    auto it = shard.blobs.find(id);
+                    if (it == shard.blobs.end()) {
+                        return false;
+                    }
+                    b = it->second;
+                }
+
+                std::lock_guard<std::mutex> lock(b->mutex);
+                b->last_access = ++_clock;
+                f(*b);
+                return true;
+            }
+
+            size_t count() const {
+                return _count;
+            }
+
+            // Spills least recently used blobs until resident size is within the memory limit.
+            void enforce_memory_limit() {
+                size_t limit = memory_limit;
+                if (limit == 0 || resident_bytes <= limit) {
+                    return;
+                }
+
+                // If another thread is already doing this, there's no need to wait for it.
+                std::unique_lock<std::mutex> spill_lock(_spill_mutex, std::try_to_lock);
+                if (!spill_lock) {
+                    return;
+                }
+
+                std::vector<std::pair<uint64_t, std::shared_ptr<stored_blob>>> blobs;
+                for (auto& shard : _shards) {
+                    std::lock_guard<std::mutex> lock(shard.mutex);
+                    for (auto& kv : shard.blobs) {
+                        blobs.emplace_back(kv.second->last_access.load(), kv.second);
+                    }
+                }
+
+                std::sort(blobs.begin(), blobs.end(), [](const decltype(blobs)::value_type& x, const decltype(blobs)::value_type& y) {
+                    return x.first < y.first;
+                });
+
+                for (auto& kv : blobs) {
+                    if (resident_bytes <= limit) {
+                        break;
+                    }
+
+                    std::lock_guard<std::mutex> lock(kv.second->mutex);
+                    if (!spill(*kv.second)) {
+                        // Most likely out of disk space, no point in trying other blobs.
+                        break;
+                    }
+                }
+            }
+
+            struct stored_blob {
+                std::mutex mutex;
+                std::vector<std::shared_ptr<blob_chunk>> chunks;
+                size_t size = 0;
+                std::atomic<uint64_t> last_access{ 0 };
+            };
+
+            static blob_view view(const stored_blob& b, size_t pos, size_t count) {
+                blob_view v;
+                if (pos >= b.size) {
+                    return v;
+                }
+
+                count = std::min(count, b.size - pos);
+                if (count == 0) {
+                    return v;
+                }
+
+                v._offset = pos % chunk_size;
+                v._size = count;
+
+                size_t first = pos / chunk_size, last = (pos + count - 1) / chunk_size;
+                v._chunks.assign(b.chunks.begin() + first, b.chunks.begin() + last + 1);
+                return v;
+            }
+
+            static void resize(stored_blob& b, size_t size) {
+                if (size < b.size) {
+                    b.chunks.resize(chunks_for(size));
+                    b.size = size;
+                } else if (size > b.size) {
+                    size_t old_size = b.size;
+                    grow(b, size);
+                    fill(b, old_size, size - old_size);
+                }
+            }
+
+            static void write(stored_blob& b, size_t pos, const char* data, size_t size) {
+                if (size == 0) {
+                    return;
+                }
+
+                size_t end = pos + size;
+                if (end > b.size) {
+                    // Only the gap between the old end and pos needs to be zeroed; the rest is overwritten below.
+                    size_t old_size = b.size;
+                    grow(b, end);
+                    if (pos > old_size) {
+                        fill(b, old_size, pos - old_size);
+                    }
+                }
+
+                for (size_t i = pos / chunk_size; pos < end; ++i) {
+                    size_t offset = pos % chunk_size;
+                    size_t n = std::min(end - pos, chunk_size - offset);
+                    memcpy(writable_chunk(b, i).data + offset, data, n);
+                    data += n;
+                    pos += n;
+                }
+            }
+
+        private:
+            struct shard {
+                std::mutex mutex;
+                std::unordered_map<blob_id, std::shared_ptr<stored_blob>> blobs;
+            };
+
+            std::atomic<blob_id> _last_id{ 1 };
+            std::atomic<uint64_t> _clock{ 0 };
+            std::atomic<size_t> _count{ 0 };
+            std::mutex _spill_mutex;
+            shard _shards[shard_count];
+
+            shard& shard_of(blob_id id) {
+                return _shards[id % shard_count];
+            }
+
+            static size_t chunks_for(size_t size) {
+                return (size + chunk_size - 1) / chunk_size;
+            }
+
+            // Number of bytes in chunk i that are part of the blob.
+            static size_t used_in_chunk(const stored_blob& b, size_t i) {
+                size_t start = i * chunk_size;
+                return b.size <= start ? 0 : std::min(chunk_size, b.size - start);
+            }
+
+            // Replaces the chunk with a private in-memory copy with the specified capacity, unless it's already private
+            // and large enough. Chunks that are shared with a blob_view must never be written to.
+            static blob_chunk& reallocate_chunk(stored_blob& b, size_t i, size_t capacity) {
+                auto& chunk = b.chunks[i];
+                if (chunk.use_count() == 1 && !chunk->is_mapped() && chunk->capacity >= capacity) {
+                    return *chunk;
+                }
+
+                auto copy = std::make_shared<blob_chunk>(std::max(capacity, chunk->capacity));
+                memcpy(copy->data, chunk->data, used_in_chunk(b, i));
+                chunk = std::move(copy);
+                return *chunk;
+            }
+
+            static blob_chunk& writable_chunk(stored_blob& b, size_t i) {
+                return reallocate_chunk(b, i, 0);
+            }
+
+            // Extends the blob to the new size, allocating chunks as needed. Contents of the new part is undefined.
+            static void grow(stored_blob& b, size_t size) {
+                size_t count = chunks_for(size);
+                for (size_t i = b.chunks.empty() ? 0 : b.chunks.size() - 1; i < count; ++i) {
+                    size_t needed = std::min(chunk_size, size - i * chunk_size);
+                    if (i < b.chunks.size()) {
+                        if (b.chunks[i]->capacity < needed) {
+                            // Grow the last chunk geometrically, so that a series of small appends is amortized O(1).
+                            reallocate_chunk(b, i, std::min(chunk_size, std::max(needed, b.chunks[i]->capacity * 2)));
+                        }
+                    } else {
+                        size_t capacity = (i == count - 1) ? std::max(needed, min_chunk_capacity) : chunk_size;
+                        b.chunks.push_back(std::make_shared<blob_chunk>(std::min(chunk_size, capacity)));
+                    }
+                }
+                b.size = size;
+            }
+
+            // Moves the contents of the blob to a temporary file, and replaces its chunks with ones that are
+            // backed by a read-only mapping of that file. Returns false if the file could not be created.
+            static bool spill(stored_blob& b) {
+                bool is_resident = std::any_of(b.chunks.begin(), b.chunks.end(), [](const std::shared_ptr<blob_chunk>& chunk) {
+                    return !chunk->is_mapped();
+                });
+                if (!is_resident) {
+                    return true;
+                }
+
+                auto mapping = map_temp_file(b.size, [&](auto f) {
+                    for (size_t i = 0; i < b.chunks.size(); ++i) {
+                        f(b.chunks[i]->data, used_in_chunk(b, i));
+                    }
+                });
+                if (!mapping) {
+                    return false;
+                }
+
+                for (size_t i = 0; i < b.chunks.size(); ++i) {
+                    b.chunks[i] = std::make_shared<blob_chunk>(mapping, mapping.get() + i * chunk_size, used_in_chunk(b, i));
+                }
+
+                ++spill_count;
+                return true;
+            }
+
+            static void fill(stored_blob& b, size_t pos, size_t size) {
+                size_t end = pos + size;
+                for (size_t i = pos / chunk_size; pos < end; ++i) {
+                    size_t offset = pos % chunk_size;
+                    size_t n = std::min(end - pos, chunk_size - offset);
+                    memset(writable_chunk(b, i).data + offset, 0, n);
+                    pos += n;
+                }
+            }
+        };
+
+        namespace {
+            blob_store store;
+        }
+
+        blob_id create_blob(const char* data, size_t size) {
+            blob_id id = store.create(data, size);
+            store.enforce_memory_limit();
+            return id;
+        }
+
+        bool get_blob(blob_id id, size_t pos, size_t count, blob_view& view) {
+            return store.with_blob(id, [&](blob_store::stored_blob& b) {
+                view = blob_store::view(b, pos, count);
+            });
+        }
+
+        bool get_blob_size(blob_id id, size_t& size) {
+            return store.with_blob(id, [&](blob_store::stored_blob& b) {
+                size = b.size;
+            });
+        }
+
+        bool set_blob_size(blob_id id, size_t size) {
+            bool found = store.with_blob(id, [&](blob_store::stored_blob& b) {
+                blob_store::resize(b, size);
+            });
+            store.enforce_memory_limit();
+            return found;
+        }
+
+        bool write_blob(blob_id id, size_t pos, const char* data, size_t size, size_t& new_size) {
+            bool found = store.with_blob(id, [&](blob_store::stored_blob& b) {
+                blob_store::write(b, pos, data, size);
+                new_size = b.size;
+            });
+            store.enforce_memory_limit();
+            return found;
+        }
+
+        bool append_blob(blob_id id, const char* data, size_t size, size_t& new_size) {
+            bool found = store.with_blob(id, [&](blob_store::stored_blob& b) {
+                blob_store::write(b, b.size, data, size);
+                new_size = b.size;
+            });
+            store.enforce_memory_limit();
+            return found;
+        }
+
+        void destroy_blob(blob_id id) {
+            store.destroy(id);
+        }
+
+        void set_memory_limit(size_t limit) {
+            memory_limit = limit;
+        }
+
+        blob_stats get_stats() {
+            blob_stats stats;
+            stats.count = store.count();
+            stats.resident_bytes = resident_bytes;
+            stats.spilled_bytes = spilled_bytes;
+            stats.spill_count = spill_count;
+            return stats;
+        }
+
         bool to_blob(SEXP sexp, std::vector<char>& blob) {
             bool result = false;
             rhost::util::errors_to_exceptions([&] {result = to_blob_internal(sexp, blob); });
@@ -100,7 +540,7 @@ namespace rhost {
         }
 
         void save_to_file(blob_id id, fs::path& file_path) {
-            auto data = rhost::host::get_blob(id);
+            auto data = get_blob(id);
 
             fs::path parent = file_path.parent_path();
             if (!fs::exists(parent)) {
@@ -116,10 +556,12 @@ namespace rhost {
                 std::fclose(f);
             });
 
-            size_t sz = std::fwrite(data.data(), sizeof(char), data.size(), f);
-            if (sz != data.size()) {
-                throw std::runtime_error("Error while writing blob to file.");
-            }
+            data.for_each_segment([&](const char* p, size_t size) {
+                size_t sz = std::fwrite(p, sizeof(char), size, f);
+                if (sz != size) {
+                    throw std::runtime_error("Error while writing blob to file.");
+                }
+            });
         }
     }
 }
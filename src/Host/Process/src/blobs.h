@@ -19,10 +19,10 @@
  * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
  *
  * ***************************************************************************/
-
 #pragma once
 #include "stdafx.h"
 #include "util.h"
+#include "log.h"
 
 namespace rhost {
     namespace blobs {
@@ -43,6 +43,140 @@ namespace rhost {
             return append_from_file(blob, path.string().c_str());
         }
 
+        // Blobs in the store are kept as a sequence of chunks. All chunks but the last one hold exactly
+        // chunk_size bytes, so that any position maps directly to a chunk; the last one is grown as needed
+        // up to chunk_size. Appending to a blob therefore never moves more than one chunk worth of data.
+        const size_t chunk_size = 0x100000;
+
+        struct blob_chunk {
+            char* data;
+            size_t capacity;
+
+            // Allocates a chunk in memory.
+            explicit blob_chunk(size_t capacity);
+
+            // Wraps a part of a read-only file mapping. The chunk keeps the mapping alive.
+            blob_chunk(std::shared_ptr<char> mapping, char* data, size_t capacity);
+
+            ~blob_chunk();
+
+            blob_chunk(const blob_chunk&) = delete;
+            blob_chunk& operator=(const blob_chunk&) = delete;
+
+            bool is_mapped() const {
+                return _mapping != nullptr;
+            }
+
+        private:
+            std::unique_ptr<char[]> _memory;
+            std::shared_ptr<char> _mapping;
+        };
+
+        // Immutable snapshot of a blob (or a part of it). It shares chunks with the store, so taking a view
+        // does not copy any data. Chunks are never modified while a view holds on to them - the store makes
+        // a private copy of a shared chunk before writing to it.
+        class blob_view {
+        public:
+            blob_view() :
+                _offset(0), _size(0) {
+            }
+
+            size_t size() const {
+                return _size;
+            }
+
+            bool empty() const {
+                return _size == 0;
+            }
+
+            // Invokes f(const char* data, size_t size) for every contiguous segment of the view, in order.
+            template <class F>
+            void for_each_segment(F f) const {
+                size_t offset = _offset, remaining = _size;
+                for (auto& chunk : _chunks) {
+                    if (remaining == 0) {
+                        break;
+                    }
+
+                    size_t n = std::min(remaining, chunk_size - offset);
+                    f(static_cast<const char*>(chunk->data + offset), n);
+                    remaining -= n;
+                    offset = 0;
+                }
+            }
+
+            void copy_to(char* dest) const {
+                for_each_segment([&](const char* data, size_t size) {
+                    memcpy(dest, data, size);
+                    dest += size;
+                });
+            }
+
+            blob to_blob() const {
+                blob result(_size);
+                copy_to(result.data());
+                return result;
+            }
+
+        private:
+            friend class blob_store;
+
+            std::vector<std::shared_ptr<const blob_chunk>> _chunks;
+            size_t _offset, _size;
+        };
+
+        // Blob store. All functions are thread-safe; operations on different blobs do not block each other.
+        // Functions that take a blob ID return false if there's no blob with that ID.
+
+        blob_id create_blob(const char* data = nullptr, size_t size = 0);
+
+        inline blob_id create_blob(const blob& blob) {
+            return create_blob(blob.data(), blob.size());
+        }
+
+        // Takes a snapshot of count bytes starting at pos. Range is clipped to the size of the blob.
+        bool get_blob(blob_id id, size_t pos, size_t count, blob_view& view);
+
+        inline bool get_blob(blob_id id, blob_view& view) {
+            return get_blob(id, 0, std::numeric_limits<size_t>::max(), view);
+        }
+
+        inline blob_view get_blob(blob_id id) {
+            blob_view view;
+            if (!get_blob(id, view)) {
+                log::fatal_error("GetBlob: no blob with ID %llu", id);
+            }
+            return view;
+        }
+
+        bool get_blob_size(blob_id id, size_t& size);
+
+        // Truncates the blob, or extends it with zeros.
+        bool set_blob_size(blob_id id, size_t size);
+
+        // Writes data at pos, extending the blob if necessary (with zeros if pos is past the end).
+        // Returns the new size of the blob in new_size.
+        bool write_blob(blob_id id, size_t pos, const char* data, size_t size, size_t& new_size);
+
+        // Appends data to the end of the blob. Returns the new size of the blob in new_size.
+        bool append_blob(blob_id id, const char* data, size_t size, size_t& new_size);
+
+        void destroy_blob(blob_id id);
+
+        // When the total size of blobs in memory exceeds the limit, least recently used blobs are spilled
+        // to temporary files, which are then memory-mapped, so that they can still be read transparently.
+        // Writing to a spilled blob brings the affected chunks back into memory. 0 means no limit.
+        void set_memory_limit(size_t limit);
+
+        struct blob_stats {
+            size_t count;
+            size_t resident_bytes; // includes chunks that are no longer in the store, but still referenced by views
+            size_t spilled_bytes;
+            size_t spill_count; // how many times a blob was spilled
+        };
+
+        blob_stats get_stats();
+
         void save_to_file(blob_id id, fs::path& file_path);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,382 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+
+// Implementation of Grisu2 follows "Printing Floating-Point Numbers Quickly and Accurately with Integers"
+// by Florian Loitsch (PLDI 2010). Grisu2 always produces output that round-trips, and in ~99.9% of cases
+// it is also the shortest possible one; in the remaining cases, it's at most one digit longer.
+
+#include "dtoa.h"
+
+namespace rhost {
+    namespace dtoa {
+        namespace {
+            // Unnormalized floating-point number with 64-bit significand: f * 2^e.
+            struct diy_fp {
+                uint64_t f;
+                int e;
+            };
+
+            diy_fp sub(diy_fp x, diy_fp y) {
+                assert(x.e == y.e && x.f >= y.f);
+                return{ x.f - y.f, x.e };
+            }
+
+            // Upper 64 bits of the 128-bit product of significands, rounded.
+            diy_fp mul(diy_fp x, diy_fp y) {
+                uint64_t x_lo = x.f & 0xFFFFFFFFu, x_hi = x.f >> 32;
+                uint64_t y_lo = y.f & 0xFFFFFFFFu, y_hi = y.f >> 32;
+
+                uint64_t p0 = x_lo * y_lo;
+                uint64_t p1 = x_lo * y_hi;
+                uint64_t p2 = x_hi * y_lo;
+                uint64_t p3 = x_hi * y_hi;
+
+                uint64_t mid = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+                mid += 1u << 31;
+
+                return{ p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32), x.e + y.e + 64 };
+            }
+
+            diy_fp normalize(diy_fp x) {
+                while ((x.f >> 63) == 0) {
+                    x.f <<= 1;
+                    --x.e;
+                }
+                return x;
+            }
+
+            diy_fp normalize_to(diy_fp x, int e) {
+                int delta = x.e - e;
+                assert(delta >= 0 && ((x.f << delta) >> delta) == x.f);
+                return{ x.f << delta, e };
+            }
+
+            // Value v, and the boundaries m- and m+ of the interval of real numbers that round to v;
+            // all three are normalized to the same exponent.
+            struct boundaries {
+                diy_fp w, minus, plus;
+            };
+
+            boundaries compute_boundaries(double value) {
+                const int significand_size = 52;
+                const int exponent_bias = 1023 + significand_size;
+                const int min_exponent = 1 - exponent_bias;
+                const uint64_t hidden_bit = uint64_t(1) << significand_size;
+
+                uint64_t bits;
+                memcpy(&bits, &value, sizeof bits);
+                uint64_t F = bits & (hidden_bit - 1);
+                int E = static_cast<int>(bits >> significand_size);
+
+                diy_fp v = (E == 0) ? diy_fp{ F, min_exponent } : diy_fp{ F + hidden_bit, E - exponent_bias };
+
+                // For powers of two (other than the smallest normal), the next smaller double is closer
+                // than the next larger one, so the lower boundary is twice as close.
+                bool lower_boundary_is_closer = (F == 0 && E > 1);
+                diy_fp m_plus = { 2 * v.f + 1, v.e - 1 };
+                diy_fp m_minus = lower_boundary_is_closer ? diy_fp{ 4 * v.f - 1, v.e - 2 } : diy_fp{ 2 * v.f - 1, v.e - 1 };
+
+                diy_fp w_plus = normalize(m_plus);
+                return{ normalize(v), normalize_to(m_minus, w_plus.e), w_plus };
+            }
+
+            // The product of w and the cached power is chosen so that its binary exponent is in this range,
+            // which lets digit generation work with 32-bit integer part and 64-bit fraction.
+            const int alpha = -60;
+            const int gamma = -32;
+
+            struct cached_power {
+                uint64_t f;
+                int e;
+                int k;
+            };
+
+            // Normalized 10^k, rounded to 64 bits, for k from -300 to 324 in steps of 8.
+            // Generated with exact rational arithmetic.
+            const cached_power cached_powers[] = {
+                { 0xAB70FE17C79AC6CA, -1060, -300 },
+                { 0xFF77B1FCBEBCDC4F, -1034, -292 },
+                { 0xBE5691EF416BD60C, -1007, -284 },
+                { 0x8DD01FAD907FFC3C, -980, -276 },
+                { 0xD3515C2831559A83, -954, -268 },
+                { 0x9D71AC8FADA6C9B5, -927, -260 },
+                { 0xEA9C227723EE8BCB, -901, -252 },
+                { 0xAECC49914078536D, -874, -244 },
+                { 0x823C12795DB6CE57, -847, -236 },
+                { 0xC21094364DFB5637, -821, -228 },
+                { 0x9096EA6F3848984F, -794, -220 },
+                { 0xD77485CB25823AC7, -768, -212 },
+                { 0xA086CFCD97BF97F4, -741, -204 },
+                { 0xEF340A98172AACE5, -715, -196 },
+                { 0xB23867FB2A35B28E, -688, -188 },
+                { 0x84C8D4DFD2C63F3B, -661, -180 },
+                { 0xC5DD44271AD3CDBA, -635, -172 },
+                { 0x936B9FCEBB25C996, -608, -164 },
+                { 0xDBAC6C247D62A584, -582, -156 },
+                { 0xA3AB66580D5FDAF6, -555, -148 },
+                { 0xF3E2F893DEC3F126, -529, -140 },
+                { 0xB5B5ADA8AAFF80B8, -502, -132 },
+                { 0x87625F056C7C4A8B, -475, -124 },
+                { 0xC9BCFF6034C13053, -449, -116 },
+                { 0x964E858C91BA2655, -422, -108 },
+                { 0xDFF9772470297EBD, -396, -100 },
+                { 0xA6DFBD9FB8E5B88F, -369, -92 },
+                { 0xF8A95FCF88747D94, -343, -84 },
+                { 0xB94470938FA89BCF, -316, -76 },
+                { 0x8A08F0F8BF0F156B, -289, -68 },
+                { 0xCDB02555653131B6, -263, -60 },
+                { 0x993FE2C6D07B7FAC, -236, -52 },
+                { 0xE45C10C42A2B3B06, -210, -44 },
+                { 0xAA242499697392D3, -183, -36 },
+                { 0xFD87B5F28300CA0E, -157, -28 },
+                { 0xBCE5086492111AEB, -130, -20 },
+                { 0x8CBCCC096F5088CC, -103, -12 },
+                { 0xD1B71758E219652C, -77, -4 },
+                { 0x9C40000000000000, -50, 4 },
+                { 0xE8D4A51000000000, -24, 12 },
+                { 0xAD78EBC5AC620000, 3, 20 },
+                { 0x813F3978F8940984, 30, 28 },
+                { 0xC097CE7BC90715B3, 56, 36 },
+                { 0x8F7E32CE7BEA5C70, 83, 44 },
+                { 0xD5D238A4ABE98068, 109, 52 },
+                { 0x9F4F2726179A2245, 136, 60 },
+                { 0xED63A231D4C4FB27, 162, 68 },
+                { 0xB0DE65388CC8ADA8, 189, 76 },
+                { 0x83C7088E1AAB65DB, 216, 84 },
+                { 0xC45D1DF942711D9A, 242, 92 },
+                { 0x924D692CA61BE758, 269, 100 },
+                { 0xDA01EE641A708DEA, 295, 108 },
+                { 0xA26DA3999AEF774A, 322, 116 },
+                { 0xF209787BB47D6B85, 348, 124 },
+                { 0xB454E4A179DD1877, 375, 132 },
+                { 0x865B86925B9BC5C2, 402, 140 },
+                { 0xC83553C5C8965D3D, 428, 148 },
+                { 0x952AB45CFA97A0B3, 455, 156 },
+                { 0xDE469FBD99A05FE3, 481, 164 },
+                { 0xA59BC234DB398C25, 508, 172 },
+                { 0xF6C69A72A3989F5C, 534, 180 },
+                { 0xB7DCBF5354E9BECE, 561, 188 },
+                { 0x88FCF317F22241E2, 588, 196 },
+                { 0xCC20CE9BD35C78A5, 614, 204 },
+                { 0x98165AF37B2153DF, 641, 212 },
+                { 0xE2A0B5DC971F303A, 667, 220 },
+                { 0xA8D9D1535CE3B396, 694, 228 },
+                { 0xFB9B7CD9A4A7443C, 720, 236 },
+                { 0xBB764C4CA7A44410, 747, 244 },
+                { 0x8BAB8EEFB6409C1A, 774, 252 },
+                { 0xD01FEF10A657842C, 800, 260 },
+                { 0x9B10A4E5E9913129, 827, 268 },
+                { 0xE7109BFBA19C0C9D, 853, 276 },
+                { 0xAC2820D9623BF429, 880, 284 },
+                { 0x80444B5E7AA7CF85, 907, 292 },
+                { 0xBF21E44003ACDD2D, 933, 300 },
+                { 0x8E679C2F5E44FF8F, 960, 308 },
+                { 0xD433179D9C8CB841, 986, 316 },
+                { 0x9E19DB92B4E31BA9, 1013, 324 },
+            };
+
+            const int cached_powers_min_k = -300;
+            const int cached_powers_k_step = 8;
+
+            // Returns c = 10^k such that alpha <= e_c + e + 64 <= gamma.
+            cached_power get_cached_power(int e) {
+                // k = ceil((alpha - e - 1) * log10(2)); 78913 / 2^18 approximates log10(2).
+                int f = alpha - e - 1;
+                int k = (f * 78913) / (1 << 18) + (f > 0);
+
+                int index = (-cached_powers_min_k + k + (cached_powers_k_step - 1)) / cached_powers_k_step;
+                assert(index >= 0 && static_cast<size_t>(index) < sizeof cached_powers / sizeof *cached_powers);
+
+                cached_power c = cached_powers[index];
+                assert(alpha <= c.e + e + 64 && c.e + e + 64 <= gamma);
+                return c;
+            }
+
+            // Returns the number of decimal digits in n, and the largest power of 10 not greater than n.
+            int find_largest_pow10(uint32_t n, uint32_t& pow10) {
+                static const uint32_t powers[] = {
+                    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+                };
+
+                int digits = 10;
+                while (digits > 1 && n < powers[digits - 1]) {
+                    --digits;
+                }
+                pow10 = powers[digits - 1];
+                return digits;
+            }
+
+            // Moves the last digit closer to w while staying within the rounding interval.
+            void round_weed(char* buf, int len, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k) {
+                while (rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+                    --buf[len - 1];
+                    rest += ten_k;
+                }
+            }
+
+            // Generates the shortest digit string in (M-, M+), as close to w as possible. The result is
+            // buf[0..len) * 10^exponent.
+            void generate_digits(char* buf, int& len, int& exponent, diy_fp m_minus, diy_fp w, diy_fp m_plus) {
+                uint64_t delta = sub(m_plus, m_minus).f;
+                uint64_t dist = sub(m_plus, w).f;
+
+                // Split M+ into integral part p1 and fractional part p2, at the binary point 2^e.
+                const diy_fp one = { uint64_t(1) << -m_plus.e, m_plus.e };
+                uint32_t p1 = static_cast<uint32_t>(m_plus.f >> -one.e);
+                uint64_t p2 = m_plus.f & (one.f - 1);
+
+                uint32_t pow10;
+                int n = find_largest_pow10(p1, pow10);
+
+                len = 0;
+                while (n > 0) {
+                    buf[len++] = static_cast<char>('0' + p1 / pow10);
+                    p1 %= pow10;
+                    --n;
+
+                    uint64_t rest = (uint64_t(p1) << -one.e) + p2;
+                    if (rest <= delta) {
+                        exponent += n;
+                        round_weed(buf, len, dist, delta, rest, uint64_t(pow10) << -one.e);
+                        return;
+                    }
+
+                    pow10 /= 10;
+                }
+
+                // Integral part is exhausted, continue with the fraction until within the interval.
+                int m = 0;
+                for (;;) {
+                    p2 *= 10;
+                    buf[len++] = static_cast<char>('0' + (p2 >> -one.e));
+                    p2 &= one.f - 1;
+                    ++m;
+
+                    delta *= 10;
+                    dist *= 10;
+                    if (p2 <= delta) {
+                        break;
+                    }
+                }
+
+                exponent -= m;
+                round_weed(buf, len, dist, delta, p2, one.f);
+            }
+
+            // Writes the shortest digits of a positive finite value; the result is buf[0..len) * 10^exponent.
+            void grisu2(char* buf, int& len, int& exponent, double value) {
+                boundaries b = compute_boundaries(value);
+                cached_power c = get_cached_power(b.plus.e);
+                diy_fp c_minus_k = { c.f, c.e };
+
+                diy_fp w = mul(b.w, c_minus_k);
+                diy_fp w_minus = mul(b.minus, c_minus_k);
+                diy_fp w_plus = mul(b.plus, c_minus_k);
+
+                // Multiplication introduces an error of at most 1 ulp, so shrink the interval accordingly
+                // to guarantee that whatever is generated within it still rounds to the same value.
+                diy_fp m_minus = { w_minus.f + 1, w_minus.e };
+                diy_fp m_plus = { w_plus.f - 1, w_plus.e };
+
+                exponent = -c.k;
+                generate_digits(buf, len, exponent, m_minus, w, m_plus);
+            }
+
+            char* write_exponent(int e, char* p) {
+                *p++ = 'e';
+                if (e < 0) {
+                    *p++ = '-';
+                    e = -e;
+                } else {
+                    *p++ = '+';
+                }
+
+                if (e >= 100) {
+                    *p++ = static_cast<char>('0' + e / 100);
+                    e %= 100;
+                }
+                *p++ = static_cast<char>('0' + e / 10);
+                *p++ = static_cast<char>('0' + e % 10);
+                return p;
+            }
+
+            // Given digits buf[0..len) * 10^exponent, lays them out in buf in positional or exponential
+            // notation, and returns a pointer past the last character.
+            char* format_digits(char* buf, int len, int exponent) {
+                const int min_exp = -4;
+                const int max_exp = 15;
+
+                // Position of the decimal point relative to the first digit.
+                int n = len + exponent;
+
+                if (len <= n && n <= max_exp) {
+                    // Integer: digits followed by zeros.
+                    memset(buf + len, '0', n - len);
+                    return buf + n;
+                }
+
+                if (0 < n && n <= max_exp) {
+                    // dig.its
+                    memmove(buf + n + 1, buf + n, len - n);
+                    buf[n] = '.';
+                    return buf + len + 1;
+                }
+
+                if (min_exp < n && n <= 0) {
+                    // 0.[000]digits
+                    memmove(buf + 2 - n, buf, len);
+                    buf[0] = '0';
+                    buf[1] = '.';
+                    memset(buf + 2, '0', -n);
+                    return buf + 2 - n + len;
+                }
+
+                // d[.igits]e+XX
+                if (len == 1) {
+                    return write_exponent(n - 1, buf + 1);
+                }
+
+                memmove(buf + 2, buf + 1, len - 1);
+                buf[1] = '.';
+                return write_exponent(n - 1, buf + len + 1);
+            }
+        }
+
+        char* format_shortest(double value, char* buf) {
+            assert(std::isfinite(value));
+
+            if (std::signbit(value)) {
+                *buf++ = '-';
+                value = -value;
+            }
+
+            if (value == 0) {
+                *buf++ = '0';
+                return buf;
+            }
+
+            int len, exponent;
+            grisu2(buf, len, exponent, value);
+            return format_digits(buf, len, exponent);
+        }
+    }
+}
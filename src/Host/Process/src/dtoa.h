@@ -0,0 +1,40 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+#pragma once
+#include "stdafx.h"
+
+namespace rhost {
+    namespace dtoa {
+        // Size of the buffer that is sufficient for any output of format_shortest.
+        const size_t max_length = 32;
+
+        // Formats a finite double with decimal digits that parse back to exactly the same value (Grisu2
+        // algorithm), and returns a pointer past the last written character. The output is a valid JSON
+        // number, and does not depend on the current locale. Numbers with decimal exponent in [-4, 15) are
+        // written in positional notation, and all others in exponential (e.g. "1.5e+300").
+        //
+        // The output always round-trips, but it is not always the shortest one: in rare cases, it has one
+        // digit more than necessary (e.g. 1e23 is written as "9.999999999999999e+22"). Round-tripping is
+        // checked by test/dtoa_test.cpp.
+        char* format_shortest(double value, char* buf);
+    }
+}
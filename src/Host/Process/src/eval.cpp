@@ -26,6 +26,107 @@ namespace rhost {
     namespace eval {
         bool was_eval_canceled;
 
+        namespace {
+            const size_t parse_cache_capacity = 64;
+
+            // Longer expressions are most likely one-off console input or sourced code, and not worth caching.
+            const size_t parse_cache_max_length = 4096;
+
+            struct parse_cache_entry {
+                std::string expr;
+                util::protected_sexp parsed;
+            };
+
+            // Most recently used entries are at the front. Only accessed on the R thread.
+            std::list<parse_cache_entry> parse_cache;
+            std::unordered_map<std::string, std::list<parse_cache_entry>::iterator> parse_cache_index;
+            size_t parse_cache_hits, parse_cache_misses;
+        }
+
+        util::protected_sexp parse_expr(const std::string& expr, ParseStatus& parse_status, bool use_cache) {
+            using namespace rhost::util;
+
+            // R_ParseVector is called without a srcfile, so srcrefs are never attached regardless of keep.source,
+            // and the text alone fully determines the result.
+            bool is_cacheable = use_cache && expr.size() <= parse_cache_max_length;
+            if (is_cacheable) {
+                auto it = parse_cache_index.find(expr);
+                if (it != parse_cache_index.end()) {
+                    ++parse_cache_hits;
+                    parse_cache.splice(parse_cache.begin(), parse_cache, it->second);
+                    parse_status = PARSE_OK;
+                    return it->second->parsed;
+                }
+            }
+            ++parse_cache_misses;
+
+            protected_sexp sexp_expr(Rf_allocVector3(STRSXP, 1, nullptr));
+            SET_STRING_ELT(sexp_expr.get(), 0, Rf_mkChar(expr.c_str()));
+
+            protected_sexp sexp_parsed(R_ParseVector(sexp_expr.get(), -1, &parse_status, R_NilValue));
+            if (is_cacheable && parse_status == PARSE_OK) {
+                if (parse_cache.size() >= parse_cache_capacity) {
+                    parse_cache_index.erase(parse_cache.back().expr);
+                    parse_cache.pop_back();
+                }
+                parse_cache.push_front(parse_cache_entry{ expr, sexp_parsed });
+                parse_cache_index[expr] = parse_cache.begin();
+            }
+
+            return sexp_parsed;
+        }
+
+        parse_cache_stats get_parse_cache_stats() {
+            parse_cache_stats stats;
+            stats.count = parse_cache.size();
+            stats.hits = parse_cache_hits;
+            stats.misses = parse_cache_misses;
+            return stats;
+        }
+
+        bool bracket_scanner::scan(const char* p, const char* end) {
+            for (; p != end; ++p) {
+                char c = *p;
+                if (_quote) {
+                    if (c == '\\') {
+                        if (p + 1 != end) {
+                            ++p;
+                        }
+                    } else if (c == _quote) {
+                        _quote = 0;
+                    }
+                    continue;
+                }
+
+                switch (c) {
+                case '#':
+                    p = static_cast<const char*>(memchr(p, '\n', end - p));
+                    if (!p) {
+                        return _depth == 0;
+                    }
+                    break;
+                case '"':
+                case '\'':
+                case '`':
+                    _quote = c;
+                    break;
+                case '(':
+                case '[':
+                case '{':
+                    ++_depth;
+                    break;
+                case ')':
+                case ']':
+                case '}':
+                    if (_depth > 0) {
+                        --_depth;
+                    }
+                    break;
+                }
+            }
+            return _depth == 0 && !_quote;
+        }
+
         void interrupt_eval() {
             was_eval_canceled = true;
             Rf_onintr();
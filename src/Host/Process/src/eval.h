@@ -38,60 +38,165 @@ namespace rhost {
             bool is_canceled;
         };
 
+        struct parse_cache_stats {
+            size_t count;
+            size_t hits;
+            size_t misses;
+        };
+
+        // Parses expr into an EXPRSXP. Unless use_cache is false, successful parses of short expressions are kept
+        // in an LRU cache keyed by the text, so that repeated evaluations of the same expression don't have to
+        // parse it again.
+        util::protected_sexp parse_expr(const std::string& expr, ParseStatus& parse_status, bool use_cache = true);
+
+        parse_cache_stats get_parse_cache_stats();
+
+        // Tracks nesting of brackets, and string literals, across lines of R code, to tell when the lines scanned
+        // so far cannot possibly form complete expressions. This is only a lexical approximation - e.g. it doesn't
+        // know about raw strings - but it's only used to skip parse attempts that would fail anyway, so getting it
+        // wrong merely costs a parse that could have been skipped, or delays one until more lines are read.
+        class bracket_scanner {
+        public:
+            // Scans [p, end), and returns false if the code scanned so far is definitely incomplete.
+            bool scan(const char* p, const char* end);
+
+            void reset() {
+                _depth = 0;
+                _quote = 0;
+            }
+
+        private:
+            int _depth = 0;
+            char _quote = 0; // opening quote or backtick while inside a string literal or a quoted name
+        };
+
+        // Evaluates a single parsed top-level expression into result, replacing (and thereby releasing) whatever
+        // result was there before.
         template <class FBefore, class FAfter>
-        inline std::vector<r_eval_result<util::protected_sexp>> r_try_eval(const std::string& expr, SEXP env, ParseStatus& parse_status, FBefore before = [] {}, FAfter after = [] {}) {
-            using namespace rhost::util;
+        inline void r_try_eval_expr(SEXP expr, SEXP env, r_eval_result<util::protected_sexp>& result, FBefore& before, FAfter& after) {
+            result = r_eval_result<util::protected_sexp>();
+
+            struct eval_data_t {
+                SEXP expr;
+                SEXP env;
+                decltype(result)& result_ref;
+                FBefore& before;
+                FAfter& after;
+            } eval_data = { expr, env, result, before, after };
+
+            // Reset debug flag to avoid eval entering Browse mode.
+            int rdebug = RDEBUG(env);
+            SET_RDEBUG(env, 0);
+
+            result.has_error = !rhost::util::r_top_level_exec([&] {
+                eval_data.before();
+                was_eval_canceled = false;
+                eval_data.result_ref.value.reset(Rf_eval(eval_data.expr, eval_data.env));
+                eval_data.after();
+            });
+            result.is_canceled = was_eval_canceled;
+            was_eval_canceled = false;
+
+            // Restore debug flag.
+            SET_RDEBUG(env, rdebug);
+
+            if (result.value) {
+                result.has_value = true;
+            }
+            if (result.has_error) {
+                if (result.is_canceled) {
+                    // R_curErrorBuf will be bogus in this case.
+                    result.error = "Evaluation canceled.";
+                } else {
+                    result.error = R_curErrorBuf();
+                }
+            }
+        }
 
-            std::vector<r_eval_result<protected_sexp>> results;
+        // Parses expr, and evaluates all top-level expressions in it in order. Returns the result of the last one;
+        // the result of every other one is released as soon as the next one starts evaluating.
+        template <class FBefore, class FAfter>
+        inline r_eval_result<util::protected_sexp> r_try_eval(const std::string& expr, SEXP env, ParseStatus& parse_status, FBefore before = [] {}, FAfter after = [] {}) {
+            using namespace rhost::util;
 
-            protected_sexp sexp_expr(Rf_allocVector3(STRSXP, 1, nullptr));
-            SET_STRING_ELT(sexp_expr.get(), 0, Rf_mkChar(expr.c_str()));
+            r_eval_result<protected_sexp> result = {};
 
-            protected_sexp sexp_parsed(R_ParseVector(sexp_expr.get(), -1, &parse_status, R_NilValue));
+            protected_sexp sexp_parsed = parse_expr(expr, parse_status);
             if (parse_status == PARSE_OK) {
-                results.resize(Rf_length(sexp_parsed.get()));
-                for (size_t i = 0; i < results.size(); ++i) {
-                    auto& result = results[i];
-
-                    struct eval_data_t {
-                        SEXP expr;
-                        SEXP env;
-                        decltype(result)& result_ref;
-                        FBefore& before;
-                        FAfter& after;
-                    } eval_data = { VECTOR_ELT(sexp_parsed.get(), i), env, result, before, after };
-
-                    // Reset debug flag to avoid eval entering Browse mode.
-                    int rdebug = RDEBUG(env);
-                    SET_RDEBUG(env, 0);
-
-                    result.has_error = !rhost::util::r_top_level_exec([&] {
-                        eval_data.before();
-                        was_eval_canceled = false;
-                        eval_data.result_ref.value.reset(Rf_eval(eval_data.expr, eval_data.env));
-                        eval_data.after();
-                    });
-                    result.is_canceled = was_eval_canceled;
-                    was_eval_canceled = false;
-
-                    // Restore debug flag.
-                    SET_RDEBUG(env, rdebug);
-
-                    if (result.value) {
-                        result.has_value = true;
-                    }
-                    if (result.has_error) {
-                        if (result.is_canceled) {
-                            // R_curErrorBuf will be bogus in this case.
-                            result.error = "Evaluation canceled.";
-                        } else {
-                            result.error = R_curErrorBuf();
-                        }
-                    }
+                for (R_len_t i = 0, n = Rf_length(sexp_parsed.get()); i < n; ++i) {
+                    r_try_eval_expr(VECTOR_ELT(sexp_parsed.get(), i), env, result, before, after);
                 }
             }
 
-            return results;
+            return result;
+        }
+
+        // Same as r_try_eval, but rather than parsing all of expr upfront, parses it line by line, and evaluates
+        // every top-level expression as soon as the lines read so far complete it. Evaluation of a long script
+        // thus starts immediately, and only the current chunk of it is held in parsed form.
+        //
+        // Unlike r_try_eval, the expressions preceding a syntax error are evaluated before the error is detected.
+        // Evaluation stops if an expression is canceled. After every top-level expression is evaluated, invokes
+        // on_progress(expressions evaluated so far, lines consumed so far).
+        //
+        // An expression that spans several lines is parsed from its first line again every time a line is added
+        // to it, but only after lines that leave all brackets and strings closed (see bracket_scanner), so e.g. a
+        // long function or block is parsed once. Expressions that are continued with a trailing operator at top
+        // level (e.g. a long "a +\n b +\n ..." chain) are still parsed once per line, which is quadratic in
+        // the number of lines.
+        template <class FBefore, class FAfter, class FProgress>
+        inline r_eval_result<util::protected_sexp> r_try_eval_streaming(const std::string& expr, SEXP env, ParseStatus& parse_status, FBefore before, FAfter after, FProgress on_progress) {
+            using namespace rhost::util;
+
+            r_eval_result<protected_sexp> result = {};
+            parse_status = PARSE_NULL;
+
+            size_t expr_count = 0, line_count = 0;
+            const char* end = expr.c_str() + expr.size();
+            const char* chunk = expr.c_str();
+            bracket_scanner scanner;
+            for (const char* p = chunk; p != end; ) {
+                const char* line = p;
+                const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+                p = eol ? eol + 1 : end;
+                ++line_count;
+
+                // The last chunk is always parsed, so that a scanner that got out of sync can't skip any code.
+                if (!scanner.scan(line, p) && p != end) {
+                    parse_status = PARSE_INCOMPLETE;
+                    continue;
+                }
+
+                // Chunks are mostly individual lines of a script, so there's no point in caching them.
+                ParseStatus ps;
+                protected_sexp sexp_parsed = parse_expr(std::string(chunk, p), ps, false);
+                if (ps == PARSE_INCOMPLETE) {
+                    parse_status = ps;
+                    continue;
+                }
+
+                chunk = p;
+                scanner.reset();
+                if (ps == PARSE_NULL) {
+                    continue;
+                }
+
+                parse_status = ps;
+                if (ps != PARSE_OK) {
+                    break;
+                }
+
+                for (R_len_t i = 0, n = Rf_length(sexp_parsed.get()); i < n && !result.is_canceled; ++i) {
+                    r_try_eval_expr(VECTOR_ELT(sexp_parsed.get(), i), env, result, before, after);
+                    on_progress(++expr_count, line_count);
+                }
+
+                if (result.is_canceled) {
+                    break;
+                }
+            }
+
+            return result;
         }
 
         template <class FBefore, class FAfter>
@@ -100,26 +205,23 @@ namespace rhost {
 
             r_eval_result<std::string> result = {};
 
-            auto results = r_try_eval(expr, env, parse_status, before, after);
-            if (!results.empty()) {
-                auto& last = *(results.end() - 1);
-
-                result.is_canceled = last.is_canceled;
-                result.has_error = last.has_error;
-                result.error = last.error;
-
-                if (last.has_value) {
-                    protected_sexp sexp_char(Rf_asChar(last.value.get()));
-                    const char* s = R_CHAR(sexp_char.get());
-                    if (s) {
-                        result.has_value = true;
-                        result.value = s;
-                    } else {
-                        result.has_value = false;
-                    }
+            auto last = r_try_eval(expr, env, parse_status, before, after);
+
+            result.is_canceled = last.is_canceled;
+            result.has_error = last.has_error;
+            result.error = last.error;
+
+            if (last.has_value) {
+                protected_sexp sexp_char(Rf_asChar(last.value.get()));
+                const char* s = R_CHAR(sexp_char.get());
+                if (s) {
+                    result.has_value = true;
+                    result.value = s;
                 } else {
                     result.has_value = false;
                 }
+            } else {
+                result.has_value = false;
             }
 
             return result;
@@ -27,6 +27,7 @@
 #include "util.h"
 #include "grdevices.h"
 #include "exports.h"
+#include "stats.h"
 
 using namespace rhost::rapi;
 
@@ -78,7 +79,7 @@ namespace rhost {
                 typedef ide::plot<ApiVer> plot;
 
             public:
-                plot_history(DevDesc* dd);
+                plot_history(DevDesc* dd, const boost::uuids::uuid& device_id);
 
                 plot* get_active() const;
                 plot* get_plot(const boost::uuids::uuid& plot_id);
@@ -102,6 +103,7 @@ namespace rhost {
                 typename std::vector<std::unique_ptr<plot>> _plots;
                 DevDesc* _device_desc;
                 bool _replaying;
+                stats::plot_history_counter _plot_counter;
 
                 class replay_mode {
                 public:
@@ -301,6 +303,7 @@ namespace rhost {
 
                 _has_pending_render = false;
 
+                auto render_start = std::chrono::steady_clock::now();
                 auto xdd = reinterpret_cast<ide_device*>(_device_desc->deviceSpecific);
                 auto path = xdd->save();
 
@@ -319,6 +322,7 @@ namespace rhost {
                 }
 
                 xdd->send(_plot_id, path);
+                stats::plot_render.record_since(render_start);
             }
 
             template <int ApiVer>
@@ -378,9 +382,10 @@ namespace rhost {
             ///////////////////////////////////////////////////////////////////////
 
             template <int ApiVer>
-            plot_history<ApiVer>::plot_history(DevDesc* dd) :
+            plot_history<ApiVer>::plot_history(DevDesc* dd, const boost::uuids::uuid& device_id) :
                 _device_desc(dd),
-                _replaying(false) {
+                _replaying(false),
+                _plot_counter(boost::uuids::to_string(device_id)) {
                 _active_plot = _plots.begin();
             }
 
@@ -454,12 +459,14 @@ namespace rhost {
             void plot_history<ApiVer>::append(std::unique_ptr<plot> p) {
                 _plots.push_back(std::move(p));
                 _active_plot = std::prev(_plots.end(), 1);
+                _plot_counter.set(_plots.size());
             }
 
             template <int ApiVer>
             void plot_history<ApiVer>::clear() {
                 _plots.clear();
                 _active_plot = _plots.begin();
+                _plot_counter.set(0);
             }
 
             template <int ApiVer>
@@ -472,6 +479,7 @@ namespace rhost {
                     if (_active_plot == _plots.end() && _plots.size() > 0) {
                         _active_plot--;
                     }
+                    _plot_counter.set(_plots.size());
                 }
             }
 
@@ -997,7 +1005,7 @@ namespace rhost {
                 _height(height),
                 _resolution(resolution),
                 _debug(false),
-                _history(dd),
+                _history(dd, device_id),
                 _file_device(nullptr),
                 _file_device_type(device_type) {
             }
@@ -27,6 +27,9 @@
 #include "util.h"
 #include "json.h"
 #include "blobs.h"
+#include "binary.h"
+#include "profiler.h"
+#include "stats.h"
 #include "transport.h"
 
 using namespace std::literals;
@@ -59,6 +62,19 @@ namespace rhost {
 
 #ifdef _WIN32
         DWORD main_thread_id;
+#else
+        // Wakes up the R_checkActivity wait in send_request_and_get_response when a response or an eval request
+        // arrives. On Linux, this is a single eventfd; elsewhere, it is a self-pipe. Both ends are non-blocking,
+        // and the read end is registered as an R input handler that drains it.
+        int wakeup_read_fd = -1, wakeup_write_fd = -1;
+
+        // How long send_request_and_get_response will block waiting for input before it runs R_ProcessEvents
+        // again, if nothing else wakes it up earlier. Packages that rely on polled events (e.g. tcltk) set
+        // R_wait_usec to have them processed more often than that, in which case it is used instead.
+        const int message_loop_timeout_usec = 100000;
+
+        // Activity ID for the wakeup fd input handler; R only uses it to tell handlers apart.
+        const int wakeup_activity = 0x5248;
 #endif
         std::atomic<bool> is_waiting_for_wm(false);
         bool allow_callbacks = true, allow_intr_in_CallBack = true;
@@ -72,8 +88,19 @@ namespace rhost {
         message response;
         std::mutex response_mutex;
 
-        // Eval requests queued for execution. When eval begins executing, it is removed from this queue, and placed onto eval_stack.
-        std::queue<message> eval_requests;
+        // Priority of an eval request, as specified by its flags: 'I' for interactive, 'T' for tooling (default),
+        // and 'L' for background. Queued requests are executed in order of priority, and in order of arrival
+        // within the same priority.
+        enum eval_priority { EVAL_INTERACTIVE, EVAL_TOOLING, EVAL_BACKGROUND, EVAL_PRIORITY_COUNT };
+
+        struct queued_eval {
+            message msg;
+            std::chrono::steady_clock::time_point received;
+        };
+
+        // Eval requests queued for execution, one queue per priority. When eval begins executing, it is removed from
+        // its queue, and placed onto eval_stack.
+        std::deque<queued_eval> eval_requests[EVAL_PRIORITY_COUNT];
         std::mutex eval_requests_mutex;
 
         struct eval_info {
@@ -102,9 +129,6 @@ namespace rhost {
         message_id eval_cancel_target; // ID of the eval on the stack that is the cancellation target
         std::mutex eval_stack_mutex;
 
-        blob_id next_blob_id = 1;
-        std::map<blob_id, blob> blobs;
-        std::mutex blobs_mutex;
 
         void log_message(const char* prefix, message_id id, message_id request_id, const std::string& name, const picojson::array& args, const blob& blob) {
 #ifdef TRACE_JSON
@@ -130,31 +154,75 @@ namespace rhost {
             idling_since = std::chrono::steady_clock::now();
         }
 
-        message_id send_notification(const std::string& name, const picojson::array& args, const blob& blob) {
-            assert(name[0] == '!');
+        message_id send_notification(message&& msg) {
+            assert(msg.name()[0] == '!');
 
             reset_idle_timer();
 
-            message msg(0, name, args, blob);
-            transport::send_message(msg);
-            return msg.id();
+            auto id = msg.id();
+            transport::send_message(std::move(msg));
+            return id;
         }
 
-        template<class... Args>
-        message_id respond_to_message(const message& request, const blob& blob, Args... args) {
-            assert(request.name()[0] == '?');
+        message_id send_notification(const std::string& name, const picojson::array& args, const blob& blob) {
+            message_builder builder(0, name, blob.size());
+            json::writer& writer = builder.json();
+            writer.begin_array();
+            for (const auto& arg : args) {
+                writer.write_value(arg);
+            }
+            writer.end_array();
+            return send_notification(builder.finish(blob));
+        }
 
+        message_id send_json_notification(const std::string& name, const std::string& json, const blob& blob) {
+            message_builder builder(0, name, json.size() + blob.size());
+            builder.raw_json(json);
+            return send_notification(builder.finish(blob));
+        }
+
+        // Sends a response that was built with message_builder(request).
+        message_id send_response(message&& msg) {
             reset_idle_timer();
 
-            picojson::array json;
-            rhost::util::append(json, args...);
+            auto id = msg.id();
+            transport::send_message(std::move(msg));
+            return id;
+        }
+
+        size_t blob_size_hint(const blob& blob) {
+            return blob.size();
+        }
 
-            std::string name = request.name();
-            name[0] = ':';
+        size_t blob_size_hint(const blob_view&) {
+            return 0; // not copied into the payload
+        }
+
+        size_t blob_size_hint(const blob_writer&) {
+            return 0;
+        }
 
-            message msg(request.id(), name, json, blob);
-            transport::send_message(msg);
-            return msg.id();
+        template<class Blob, class... Args>
+        message_id send_response(const message& request, const Blob& blob, Args... args) {
+            message_builder builder(request, blob_size_hint(blob));
+            builder.args(args...);
+            return send_response(builder.finish(blob));
+        }
+
+        template<class... Args>
+        message_id respond_to_message(const message& request, const blob& blob, Args... args) {
+            return send_response(request, blob, args...);
+        }
+
+        template<class... Args>
+        message_id respond_to_message(const message& request, const blob_view& blob, Args... args) {
+            return send_response(request, blob, args...);
+        }
+
+        // The blob is produced by the writer directly in the payload of the response.
+        template<class... Args>
+        message_id respond_to_message(const message& request, const blob_writer& write_blob, Args... args) {
+            return send_response(request, write_blob, args...);
         }
 
         template<class... Args>
@@ -174,8 +242,39 @@ namespace rhost {
             return it == eval_stack.end();
         }
 
+#ifndef _WIN32
+        void drain_wakeup_fd(void*) {
+            char buf[64];
+            while (read(wakeup_read_fd, buf, sizeof buf) > 0) {
+            }
+        }
+
+        void create_wakeup_fd() {
+#ifdef __linux__
+            wakeup_read_fd = wakeup_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wakeup_read_fd == -1) {
+                fatal_error("eventfd failed with error %d", errno);
+            }
+#else
+            int fds[2];
+            if (pipe(fds) == -1) {
+                fatal_error("pipe failed with error %d", errno);
+            }
+            for (int fd : fds) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            wakeup_read_fd = fds[0];
+            wakeup_write_fd = fds[1];
+#endif
+
+            addInputHandler(R_InputHandlers, wakeup_read_fd, drain_wakeup_fd, wakeup_activity);
+        }
+#endif
+
         // Unblock any pending with_response call that is waiting in a message loop.
         void unblock_message_loop() {
+#ifdef _WIN32
             // Because PeekMessage can dispatch messages that were sent, which may in turn result 
             // in nested evaluation of R code and nested message loops, sending a single WM_NULL
             // may not be sufficient, so keep sending them until the waiting flag is cleared - 
@@ -185,9 +284,7 @@ namespace rhost {
             // pumping events and return to PeekMessage.
             auto delay = 10ms;
             for (; is_waiting_for_wm; std::this_thread::sleep_for(delay)) {
-#ifdef _WIN32
                 PostThreadMessage(main_thread_id, WM_NULL, 0, 0);
-#endif
 
                 // Further guard against overflowing the queue by posting to it too aggressively.
                 // If previous wait didn't help, give it a little more time to process next message,
@@ -196,6 +293,14 @@ namespace rhost {
                     delay *= 2;
                 }
             }
+#else
+            // The wakeup fd stays readable until the message loop drains it, so a single write is enough even
+            // if the loop hasn't started waiting yet. If the pipe is full, it is already signaled, so a failed
+            // write can be ignored.
+            uint64_t one = 1;
+            ssize_t written = write(wakeup_write_fd, &one, sizeof one);
+            (void)written;
+#endif
         }
 
         void terminate_if_disconnected() {
@@ -264,11 +369,10 @@ namespace rhost {
                 return;
             }
 
-            auto json = msg.json();
-            if (!json[0].is<bool>()) {
+            if (!msg.arg_is<bool>(0)) {
                 fatal_error("Invalid evaluation request: 1 boolean argument expected");
             }
-            auto save_rdata = json[0].get<bool>();
+            auto save_rdata = msg.arg<bool>(0);
 
             request_shutdown(save_rdata);
         }
@@ -293,259 +397,344 @@ namespace rhost {
 
         void create_blob(const message& msg) {
             assert(!strcmp(msg.name(), "?CreateBlob"));
-            
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            blobs::blob_id id = ++next_blob_id;
 
-            // Check that it never overflows double mantissa, and provide immediate diagnostics if it happens.
-            if (id != blobs::blob_id(double(id))) {
-                fatal_error("CreateBlob: Blob ID overflow");
-            }
-            
             // Create a empty blob
-            blobs[id] = blobs::blob();
-
+            blobs::blob_id id = blobs::create_blob();
             respond_to_message(msg, static_cast<double>(id));
         }
 
-        blobs::blob_id create_blob(blobs::blob&& blob) {
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            blobs::blob_id id = ++next_blob_id;
-
-            // Check that it never overflows double mantissa, and provide immediate diagnostics if it happens.
-            if (id != blobs::blob_id(double(id))) {
-                fatal_error("Blob ID overflow");
-            }
-
-            blobs[id] = std::move(blob);
-            return id;
-        }
-
-        bool get_blob(blobs::blob_id id, blobs::blob& blob) {
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            auto it = blobs.find(id);
-
-            if (it == blobs.end()) {
-                return false;
-            }
-
-            blob = it->second;
-            return true;
-        }
-
-        void destroy_blob(blobs::blob_id blob_id) {
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            blobs.erase(blob_id);
-        }
-
         void destroy_blobs(const message& msg) {
             assert(!strcmp(msg.name(), "!DestroyBlob"));
 
-            auto json = msg.json();
-
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            for (auto val : json) {
-                if (!val.is<double>()) {
+            for (size_t i = 0; i < msg.arg_count(); ++i) {
+                if (!msg.arg_is<double>(i)) {
                     fatal_error("DestroyBlob: non-numeric blob ID");
                 }
 
-                auto id = static_cast<blobs::blob_id>(val.get<double>());
-                blobs.erase(id);
+                auto id = static_cast<blobs::blob_id>(msg.arg<double>(i));
+                blobs::destroy_blob(id);
             }
         }
 
         void get_blob_size(const message& msg) {
             assert(!strcmp(msg.name(), "?GetBlobSize"));
 
-            auto json = msg.json();
-            if (!json[0].is<double>()) {
+            if (!msg.arg_is<double>(0)) {
                 fatal_error("GetBlobSize: non-numeric blob ID");
             }
-            auto id = static_cast<blobs::blob_id>(json[0].get<double>());
+            auto id = static_cast<blobs::blob_id>(msg.arg<double>(0));
 
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            auto it = blobs.find(id);
-            if (it == blobs.end()) {
+            size_t size;
+            if (!blobs::get_blob_size(id, size)) {
                 fatal_error("GetBlobSize: no blob with ID %llu", id);
             }
 
-            respond_to_message(msg, ensure_fits_double(it->second.size()));
+            respond_to_message(msg, ensure_fits_double(size));
         }
 
         void set_blob_size(const message& msg) {
             assert(!strcmp(msg.name(), "!SetBlobSize"));
 
-            auto json = msg.json();
-            if (!json[0].is<double>()) {
+            if (!msg.arg_is<double>(0)) {
                 fatal_error("SetBlobSize: non-numeric blob ID");
             }
-            auto id = static_cast<blobs::blob_id>(json[0].get<double>());
+            auto id = static_cast<blobs::blob_id>(msg.arg<double>(0));
 
-            if (!json[1].is<double>()) {
+            if (!msg.arg_is<double>(1)) {
                 fatal_error("SetBlobSize: non-numeric blob Size");
             }
-            auto size = static_cast<size_t>(json[1].get<double>());
+            auto size = static_cast<size_t>(msg.arg<double>(1));
 
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            auto it = blobs.find(id);
-            if (it == blobs.end()) {
+            if (!blobs::set_blob_size(id, size)) {
                 fatal_error("SetBlobSize: no blob with ID %llu", id);
             }
 
-            it->second.resize(size);
-            respond_to_message(msg, ensure_fits_double(it->second.size()));
+            respond_to_message(msg, ensure_fits_double(size));
         }
 
         void read_blob(const message& msg) {
             assert(!strcmp(msg.name(), "?ReadBlob"));
 
-            auto json = msg.json();
-            if (!json[0].is<double>()) {
+            if (!msg.arg_is<double>(0)) {
                 fatal_error("ReadBlob: non-numeric blob ID");
             }
-            auto id = static_cast<blobs::blob_id>(json[0].get<double>());
+            auto id = static_cast<blobs::blob_id>(msg.arg<double>(0));
 
-            if (!json[1].is<double>()) {
+            if (!msg.arg_is<double>(1)) {
                 fatal_error("ReadBlob: non-numeric position");
             }
-            long long pos = static_cast<long long>(json[1].get<double>());
+            long long pos = static_cast<long long>(msg.arg<double>(1));
             if (pos < 0) {
                 fatal_error("ReadBlob: position cannot be < 0");
             }
 
-            if (!json[2].is<double>()) {
+            if (!msg.arg_is<double>(2)) {
                 fatal_error("ReadBlob: non-numeric byte count");
             }
-            long long count = static_cast<long long>(json[2].get<double>());
+            long long count = static_cast<long long>(msg.arg<double>(2));
 
             if (count < -1) {
                 fatal_error("ReadBlob: byte count cannot be < -1");
             }
 
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            auto it = blobs.find(id);
-            if (it == blobs.end()) {
+            // The view is a snapshot that shares chunks with the store - the blob is only locked while the view
+            // is taken, and the response is written directly from those chunks, without copying. Concurrent
+            // writes to the blob do not affect what's sent. If pos is past the end, the view is empty - .net
+            // stream read requires that to identify end-of-stream.
+            size_t n = count == -1 ? std::numeric_limits<size_t>::max() : static_cast<size_t>(count);
+            blobs::blob_view view;
+            if (!blobs::get_blob(id, static_cast<size_t>(pos), n, view)) {
                 fatal_error("ReadBlob: no blob with ID %llu", id);
             }
 
-            if (pos >= static_cast<long long>(it->second.size()) && count >= 0) {
-                // .net stream read requires an empty/zero sized read to identify end-of-stream.
-                blobs::blob empty;
-                respond_to_message(msg, empty);
-                return;
-            }
+            respond_to_message(msg, view);
+        }
 
-            if (pos == 0 && count == -1) {
-                // Read all
-                respond_to_message(msg, it->second);
-                return;
-            } 
-            
-            // Read at position and count
-            size_t size = static_cast<size_t>(pos);
-            size += static_cast<size_t>(count);
-            if (count == -1 || size > it->second.size()) {
-                count = it->second.size() - pos;
+        void start_profiler(const message& msg) {
+            assert(!strcmp(msg.name(), "!StartProfiler"));
+
+            if (!msg.arg_is<double>(0)) {
+                fatal_error("StartProfiler: non-numeric sampling interval");
+            }
+            auto interval = msg.arg<double>(0);
+            if (!(interval >= 1)) {
+                fatal_error("StartProfiler: sampling interval must be at least 1 ms");
             }
 
-            blobs::blob::const_iterator begin = it->second.begin() + static_cast<size_t>(pos);
-            blobs::blob::const_iterator end = begin + static_cast<size_t>(count);
+            profiler::start(std::chrono::milliseconds(static_cast<long long>(interval)));
+        }
+
+        void get_profile(const message& msg) {
+            assert(!strcmp(msg.name(), "?GetProfile"));
+
+            // The folded stacks are sent as the blob.
+            profiler::profile profile = profiler::take_profile();
+            respond_to_message(msg, blob_writer([&](std::string& payload) {
+                payload += profile.folded;
+            }), ensure_fits_double(profile.sample_count), ensure_fits_double(profile.dropped_count));
+        }
 
-            blobs::blob part(begin, end);
-            respond_to_message(msg, part);
+        void get_stats(const message& msg) {
+            assert(!strcmp(msg.name(), "?Stats"));
+
+            message_builder builder(msg);
+            json::writer& writer = builder.json();
+            writer.begin_array();
+            stats::write_stats(writer);
+            writer.end_array();
+            send_response(builder.finish());
         }
 
         void write_blob(const message& msg) {
             assert(!strcmp(msg.name(), "?WriteBlob"));
 
-            auto json = msg.json();
-            if (!json[0].is<double>()) {
+            if (!msg.arg_is<double>(0)) {
                 fatal_error("WriteBlob: non-numeric blob ID");
             }
-            auto id = static_cast<blobs::blob_id>(json[0].get<double>());
+            auto id = static_cast<blobs::blob_id>(msg.arg<double>(0));
 
-            if (!json[1].is<double>()) {
+            if (!msg.arg_is<double>(1)) {
                 fatal_error("ReadBlob: non-numeric position");
             }
-            long long pos = static_cast<long long>(json[1].get<double>());
+            long long pos = static_cast<long long>(msg.arg<double>(1));
+
+            // Consume the data directly from the message payload to avoid an intermediate copy.
+            const char* data = msg.blob_data();
+            size_t data_size = msg.blob_size();
 
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            auto it = blobs.find(id);
-            if (it == blobs.end()) {
+            size_t new_size;
+            bool found = pos == -1 ?
+                blobs::append_blob(id, data, data_size, new_size) :
+                blobs::write_blob(id, static_cast<size_t>(pos), data, data_size, new_size);
+            if (!found) {
                 fatal_error("WriteBlob: no blob with ID %llu", id);
             }
 
-            if (pos == -1 || pos == it->second.size()) {
-                // append to the end of the blob
-                auto blob = msg.blob();
-                it->second.insert(it->second.end(), blob.begin(), blob.end());
-            } else {
-                // write/over-write at position
-                auto blob = msg.blob();
-                size_t size = static_cast<size_t>(pos);
-                size += blob.size();
-                if (it->second.size() < size) {
-                    it->second.resize(size);
-                }
-
-                std::copy(blob.begin(), blob.end(), it->second.begin() + static_cast<size_t>(pos));
-            }
-            
-            respond_to_message(msg, ensure_fits_double(it->second.size()));
+            respond_to_message(msg, ensure_fits_double(new_size));
         }
 
-        void handle_eval(const message& msg) {
-            assert(msg.name()[0] == '?' && msg.name()[1] == '=');
+        eval_priority get_eval_priority(const char* name) {
+            assert(name[0] == '?' && name[1] == '=');
 
-            auto args = msg.json();
-            if (args.size() != 1 || !args[0].is<std::string>()) {
-                fatal_error("Invalid evaluation request #%llu#: must have form [expr].", msg.id());
+            eval_priority priority = EVAL_TOOLING;
+            for (const char* p = name + 2; *p; ++p) {
+                switch (*p) {
+                case 'I':
+                    priority = EVAL_INTERACTIVE;
+                    break;
+                case 'T':
+                    priority = EVAL_TOOLING;
+                    break;
+                case 'L':
+                    priority = EVAL_BACKGROUND;
+                    break;
+                }
             }
+            return priority;
+        }
 
-            SCOPE_WARDEN_RESTORE(allow_callbacks);
-            allow_callbacks = false;
+        // Flags of an eval request, or of an item in a batch eval request.
+        struct eval_flags {
+            SEXP env = nullptr;
+            bool allow_callbacks = false;
+            bool is_cancelable = false;
+            bool new_env = false;
+            bool no_result = false;
+            bool raw_response = false;
+            bool binary_response = false;
+            bool streaming = false;
+            bool report_progress = false;
+            bool report_telemetry = false;
+        };
 
-            const auto& expr = from_utf8(args[0].get<std::string>());
-            log::logf(log_verbosity::traffic, "#%llu# = %s\n\n", msg.id(), expr.c_str());
+        // Performance counters of an eval with the 'm' flag, reported as the fourth element of its response
+        // triple. All times are in milliseconds; queue time counts from when the request was received until R
+        // started handling it. For batch items, that's the same for all items of the batch, and doesn't include
+        // the time spent evaluating the preceding items.
+        struct eval_telemetry {
+            double queue_ms = 0;
+            double wall_ms = 0;
+            double cpu_ms = 0;
+            double gc_ms = 0;
+            double serialize_ms = 0;
+        };
 
-            SEXP env = nullptr;
-            bool is_cancelable = false, new_env = false, no_result = false, raw_response = false;
+        // Parses eval flags; name is the message name or batch item that they came from, for error reporting.
+        eval_flags parse_eval_flags(const char* name, const char* flags) {
+            eval_flags result;
 
-            for (const char* p = msg.name() + 2; *p; ++p) {
+            for (const char* p = flags; *p; ++p) {
                 switch (char c = *p) {
                 case 'B':
                 case 'E':
-                    if (env != nullptr) {
-                        fatal_error("'%s': multiple environment flags specified.", msg.name());
+                    if (result.env != nullptr) {
+                        fatal_error("'%s': multiple environment flags specified.", name);
                     }
-                    env = (c == 'B') ? R_BaseEnv : R_EmptyEnv;
+                    result.env = (c == 'B') ? R_BaseEnv : R_EmptyEnv;
                     break;
                 case 'N':
-                    new_env = true;
+                    result.new_env = true;
                     break;
                 case '@':
-                    allow_callbacks = true;
+                    result.allow_callbacks = true;
                     break;
                 case '/':
-                    is_cancelable = true;
+                    result.is_cancelable = true;
                     break;
                 case '0':
-                    no_result = true;
+                    result.no_result = true;
                     break;
                 case 'r':
-                    raw_response = true;
+                    result.raw_response = true;
+                    break;
+                case 'b':
+                    result.binary_response = true;
+                    break;
+                case 's':
+                    result.streaming = true;
+                    break;
+                case 'p':
+                    result.report_progress = true;
+                    break;
+                case 'm':
+                    result.report_telemetry = true;
+                    break;
+                case 'I':
+                case 'T':
+                case 'L':
+                    // Priority - already accounted for when the request was queued.
                     break;
                 default:
-                    fatal_error("'%s': unrecognized flag '%c'.", msg.name(), c);
+                    fatal_error("'%s': unrecognized flag '%c'.", name, c);
                 }
             }
 
-            if (!env) {
-                env = R_GlobalEnv;
+            if (!result.env) {
+                result.env = R_GlobalEnv;
+            }
+
+            return result;
+        }
+
+        // Optional second argument of eval requests is the timeout in milliseconds, counting from when the request
+        // was received.
+        bool is_valid_eval_timeout(const message& msg) {
+            return msg.arg_count() == 1 || (msg.arg_count() == 2 && (msg.arg_is<double>(1) || msg.arg_is<picojson::null>(1)));
+        }
+
+        // If the request has been waiting in the queue for longer than its timeout, the client is no longer
+        // interested in the result, so it shouldn't be evaluated. Instead, the response is [null, "EXPIRED"],
+        // which clients that don't know about expiration will treat the same as cancellation.
+        bool respond_if_expired(const message& msg, std::chrono::steady_clock::time_point received) {
+            if (msg.arg_count() != 2 || !msg.arg_is<double>(1)) {
+                return false;
+            }
+
+            std::chrono::duration<double, std::milli> timeout(msg.arg<double>(1));
+            if (std::chrono::steady_clock::now() - received <= timeout) {
+                return false;
+            }
+
+            log::logf(log_verbosity::traffic, "#%llu# expired\n\n", msg.id());
+            message_builder builder(msg);
+            builder.args(picojson::value(), "EXPIRED");
+            send_response(builder.finish());
+            return true;
+        }
+
+        double milliseconds_since(std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        // Total time spent in R garbage collection so far, in milliseconds. R does not export GC counts or the
+        // number of bytes allocated without forcing a collection, but gc.time() is cheap. It also turns on GC
+        // timing if it wasn't on already, in which case the first reading is 0.
+        double get_gc_time_ms() {
+            double gc_time = 0;
+            r_top_level_exec([&] {
+                SEXP call = Rf_protect(Rf_allocList(1));
+                SET_TYPEOF(call, LANGSXP);
+                SETCAR(call, Rf_install("gc.time"));
+                SEXP times = Rf_eval(call, R_BaseEnv);
+                if (TYPEOF(times) == REALSXP && Rf_length(times) >= 3) {
+                    gc_time = REAL(times)[2] * 1e3;
+                }
+                Rf_unprotect(1);
+            }, __FUNCTION__);
+            return gc_time;
+        }
+
+        void write_eval_telemetry(json::writer& writer, const eval_telemetry& telemetry) {
+            writer.begin_object();
+            writer.write_key("queue_ms");
+            writer.write_number(telemetry.queue_ms);
+            writer.write_key("wall_ms");
+            writer.write_number(telemetry.wall_ms);
+            writer.write_key("cpu_ms");
+            writer.write_number(telemetry.cpu_ms);
+            writer.write_key("gc_ms");
+            writer.write_number(telemetry.gc_ms);
+            writer.write_key("serialize_ms");
+            writer.write_number(telemetry.serialize_ms);
+            writer.end_object();
+        }
+
+        // Evaluates expr on behalf of eval request msg. While it is executing, it is registered on eval_stack
+        // under the ID of msg, so that it can be canceled. If the 'm' flag is set, also measures the wall, CPU
+        // and GC time of the eval into telemetry.
+        r_eval_result<protected_sexp> evaluate(const message& msg, const std::string& expr, const eval_flags& flags, ParseStatus& ps, eval_telemetry& telemetry) {
+            log::logf(log_verbosity::traffic, "#%llu# = %s\n\n", msg.id(), expr.c_str());
+
+            auto wall_start = std::chrono::steady_clock::now();
+            double cpu_start = 0, gc_start = 0;
+            if (flags.report_telemetry) {
+                cpu_start = get_thread_cpu_time_ms();
+                gc_start = get_gc_time_ms();
             }
 
+            allow_callbacks = flags.allow_callbacks;
+
             r_eval_result<protected_sexp> result = {};
-            ParseStatus ps;
             {
                 // We must not register this eval as a potential cancellation target before it gets a chance to establish
                 // the restart context; otherwise, there is a possibility that a cancellation request will arrive during
@@ -556,7 +745,7 @@ namespace rhost {
                 bool was_before_invoked = false;
                 auto before = [&] {
                     std::lock_guard<std::mutex> lock(eval_stack_mutex);
-                    eval_stack.push_back(eval_info(msg.id(), is_cancelable));
+                    eval_stack.push_back(eval_info(msg.id(), flags.is_cancelable));
                     was_before_invoked = true;
                 };
 
@@ -584,11 +773,18 @@ namespace rhost {
                     was_after_invoked = true;
                 };
 
-                protected_sexp eval_env(new_env ? Rf_NewEnvironment(R_NilValue, R_NilValue, env) : env);
+                protected_sexp eval_env(flags.new_env ? Rf_NewEnvironment(R_NilValue, R_NilValue, flags.env) : flags.env);
 
-                auto results = r_try_eval(expr, eval_env.get(), ps, before, after);
-                if (!results.empty()) {
-                    result = results.back();
+                if (flags.streaming) {
+                    // For long scripts, report progress as [id, expressions, lines] after every top-level expression.
+                    auto on_progress = [&](size_t expr_count, size_t line_count) {
+                        if (flags.report_progress) {
+                            send_notification("!=", double(msg.id()), double(expr_count), double(line_count));
+                        }
+                    };
+                    result = r_try_eval_streaming(expr, eval_env.get(), ps, before, after, on_progress);
+                } else {
+                    result = r_try_eval(expr, eval_env.get(), ps, before, after);
                 }
 
                 // If eval was canceled, the "after" block was never executed (since it is normally run within the eval
@@ -602,52 +798,139 @@ namespace rhost {
                 allow_intr_in_CallBack = true;
             }
 
-            picojson::value parse_status;
+            if (flags.report_telemetry) {
+                telemetry.wall_ms = milliseconds_since(wall_start);
+                telemetry.cpu_ms = get_thread_cpu_time_ms() - cpu_start;
+                telemetry.gc_ms = get_gc_time_ms() - gc_start;
+            }
+
+            return result;
+        }
+
+        // Writes the parse status and the error of an eval result - the first two elements of the response triple.
+        void write_eval_status(json::writer& writer, const r_eval_result<protected_sexp>& result, ParseStatus ps) {
+            const char* parse_status = nullptr;
             switch (ps) {
             case PARSE_NULL:
-                parse_status = picojson::value("NULL");
+                parse_status = "NULL";
                 break;
             case PARSE_OK:
-                parse_status = picojson::value("OK");
+                parse_status = "OK";
                 break;
             case PARSE_INCOMPLETE:
-                parse_status = picojson::value("INCOMPLETE");
+                parse_status = "INCOMPLETE";
                 break;
             case PARSE_ERROR:
-                parse_status = picojson::value("ERROR");
+                parse_status = "ERROR";
                 break;
             case PARSE_EOF:
-                parse_status = picojson::value("EOF");
+                parse_status = "EOF";
                 break;
             default:
-                parse_status = picojson::value(double(ps));
                 break;
             }
 
-            picojson::value error, value;
-            blob blob;
+            if (parse_status) {
+                writer.write_string(parse_status, strlen(parse_status));
+            } else {
+                writer.write_number(double(ps));
+            }
+
             if (result.has_error) {
-                error = picojson::value(Rchar_to_utf8(result.error));
-            }
-            if (result.has_value && !no_result) {
-                try {
-                    if (raw_response) {
-                        errors_to_exceptions([&] { to_blob(result.value.get(), blob); });
-                    } else {
-                        errors_to_exceptions([&] { to_json(result.value.get(), value); });
+                writer.write_string(Rchar_to_utf8(result.error));
+            } else {
+                writer.write_null();
+            }
+        }
+
+        void handle_eval(const message& msg, std::chrono::steady_clock::time_point received) {
+            assert(msg.name()[0] == '?' && msg.name()[1] == '=');
+
+            if (!msg.arg_is<std::string>(0) || !is_valid_eval_timeout(msg)) {
+                fatal_error("Invalid evaluation request #%llu#: must have form [expr] or [expr, timeout].", msg.id());
+            }
+
+            SCOPE_WARDEN_RESTORE(allow_callbacks);
+
+            const auto& expr = from_utf8(msg.arg<boost::string_view>(0));
+            eval_flags flags = parse_eval_flags(msg.name(), msg.name() + 2);
+
+            if (respond_if_expired(msg, received)) {
+                return;
+            }
+
+            eval_telemetry telemetry;
+            telemetry.queue_ms = milliseconds_since(received);
+
+            ParseStatus ps;
+            auto result = evaluate(msg, expr, flags, ps, telemetry);
+
+            // The response is [parse_status, error, value], or [null] if eval was canceled; with the 'm' flag,
+            // eval_telemetry follows the value. The value is serialized by walking the R object and writing JSON
+            // text directly into the payload of the response, without constructing an intermediate picojson::value
+            // for it.
+            message_builder builder(msg);
+            json::writer& writer = builder.json();
+            writer.begin_array();
+
+            blob blob;
+            std::string binary_value;
+            bool has_binary_value = false;
+            if (result.is_canceled) {
+                writer.write_null();
+            } else {
+                write_eval_status(writer, result, ps);
+
+                auto serialize_start = std::chrono::steady_clock::now();
+                bool has_json_value = false;
+                if (result.has_value && !flags.no_result) {
+                    try {
+                        if (flags.raw_response) {
+                            errors_to_exceptions([&] { to_blob(result.value.get(), blob); });
+                        } else if (flags.binary_response) {
+                            // Telemetry is written before the blob, so binary encoding has to be done upfront
+                            // to be measured; otherwise, it's done later directly into the response payload.
+                            if (flags.report_telemetry) {
+                                errors_to_exceptions([&] { binary::to_binary(result.value.get(), binary_value); });
+                                has_binary_value = true;
+                            }
+                        } else {
+                            errors_to_exceptions([&] { to_json(result.value.get(), writer); });
+                            has_json_value = true;
+                        }
+                    } catch (r_error& err) {
+                        fatal_error("%s", err.what());
                     }
-                } catch (r_error& err) {
-                    fatal_error("%s", err.what());
+                }
+
+                if (!has_json_value) {
+                    writer.write_null();
+                }
+
+                if (flags.report_telemetry) {
+                    telemetry.serialize_ms = milliseconds_since(serialize_start);
+                    write_eval_telemetry(writer, telemetry);
                 }
             }
+            writer.end_array();
 
 #ifdef TRACE_JSON
             indent_log(+1);
 #endif
-            if (result.is_canceled) {
-                respond_to_message(msg, picojson::value());
+            if (has_binary_value) {
+                send_response(builder.finish(binary_value.data(), binary_value.size()));
+            } else if (!result.is_canceled && flags.binary_response && result.has_value && !flags.no_result) {
+                // Value is encoded straight into the response payload, so there's no intermediate copy.
+                SEXP value_sexp = result.value.get();
+                send_response(builder.finish(blob_writer([&](std::string& payload) {
+                    try {
+                        errors_to_exceptions([&] { binary::to_binary(value_sexp, payload); });
+                    } catch (r_error& err) {
+                        fatal_error("%s", err.what());
+                    }
+                })));
             } else {
-                respond_to_message(msg, blob, parse_status, error, value);
+                send_response(builder.finish(blob));
             }
 #ifdef TRACE_JSON
             indent_log(-1);
@@ -663,21 +946,140 @@ namespace rhost {
             }
         }
 
+        // Batch eval request "?=*" has the form [items] or [items, timeout], where every item is [flags, expr], with
+        // the same flags as for "?=". Only priority flags can follow the '*' in the name of the request itself.
+        //
+        // Items are evaluated in order, and the response is [triple, ...], with one [parse_status, error, value]
+        // triple per item; or [null] if any item was canceled, in which case the remaining ones are not evaluated.
+        // Raw and binary values of all items share the blob of the response: they are appended to it in order,
+        // and the value in the triple is then [offset, size] of the data in the blob.
+        void handle_eval_batch(const message& msg, std::chrono::steady_clock::time_point received) {
+            assert(msg.name()[0] == '?' && msg.name()[1] == '=' && msg.name()[2] == '*');
+
+            if (!msg.arg_is<picojson::array>(0) || !is_valid_eval_timeout(msg)) {
+                fatal_error("Invalid batch evaluation request #%llu#: must have form [items] or [items, timeout].", msg.id());
+            }
+
+            for (const char* p = msg.name() + 3; *p; ++p) {
+                if (*p != 'I' && *p != 'T' && *p != 'L') {
+                    fatal_error("'%s': unrecognized flag '%c'.", msg.name(), *p);
+                }
+            }
+
+            struct batch_item {
+                eval_flags flags;
+                std::string expr;
+            };
+
+            std::vector<batch_item> items;
+            {
+                auto items_json = msg.arg<picojson::value>(0);
+                for (const auto& item_json : items_json.get<picojson::array>()) {
+                    if (!item_json.is<picojson::array>() || item_json.get<picojson::array>().size() != 2 ||
+                        !item_json.get(0).is<std::string>() || !item_json.get(1).is<std::string>()) {
+                        fatal_error("Invalid batch evaluation request #%llu#: item must have form [flags, expr].", msg.id());
+                    }
+
+                    const auto& item_flags = item_json.get(0).get<std::string>();
+                    items.push_back(batch_item{
+                        parse_eval_flags(item_flags.c_str(), item_flags.c_str()),
+                        from_utf8(item_json.get(1).get<std::string>())
+                    });
+                }
+            }
+
+            if (respond_if_expired(msg, received)) {
+                return;
+            }
+
+            SCOPE_WARDEN_RESTORE(allow_callbacks);
+
+            message_builder builder(msg);
+            json::writer& writer = builder.json();
+            writer.begin_array();
+
+            double queue_ms = milliseconds_since(received);
+
+            std::string blob_area;
+            bool is_canceled = false;
+            for (const auto& item : items) {
+                eval_telemetry telemetry;
+                telemetry.queue_ms = queue_ms;
+
+                ParseStatus ps;
+                auto result = evaluate(msg, item.expr, item.flags, ps, telemetry);
+                if (result.is_canceled) {
+                    is_canceled = true;
+                    break;
+                }
+
+                writer.begin_array();
+                write_eval_status(writer, result, ps);
+
+                auto serialize_start = std::chrono::steady_clock::now();
+
+                if (result.has_value && !item.flags.no_result) {
+                    try {
+                        if (item.flags.raw_response || item.flags.binary_response) {
+                            size_t offset = blob_area.size();
+                            if (item.flags.raw_response) {
+                                blob blob;
+                                errors_to_exceptions([&] { to_blob(result.value.get(), blob); });
+                                blob_area.append(blob.data(), blob.size());
+                            } else {
+                                errors_to_exceptions([&] { binary::to_binary(result.value.get(), blob_area); });
+                            }
+
+                            writer.begin_array();
+                            writer.write_number(double(offset));
+                            writer.write_number(double(blob_area.size() - offset));
+                            writer.end_array();
+                        } else {
+                            errors_to_exceptions([&] { to_json(result.value.get(), writer); });
+                        }
+                    } catch (r_error& err) {
+                        fatal_error("%s", err.what());
+                    }
+                } else {
+                    writer.write_null();
+                }
+
+                if (item.flags.report_telemetry) {
+                    telemetry.serialize_ms = milliseconds_since(serialize_start);
+                    write_eval_telemetry(writer, telemetry);
+                }
+
+                writer.end_array();
+            }
+            writer.end_array();
+
+            if (is_canceled) {
+                message_builder canceled(msg);
+                canceled.args(picojson::value());
+                send_response(canceled.finish());
+            } else {
+                send_response(builder.finish(blob_area.data(), blob_area.size()));
+            }
+
+            // See handle_eval.
+            if (query_interrupt()) {
+                throw eval_cancel_error();
+            }
+        }
+
         void handle_cancel(const std::string& name, const message& msg) {
             assert(name == "!/" || name == "!//");
-            auto args = msg.json();
-
             message_id eval_id;
             if (name == "!//") {
-                if (!args.empty()) {
+                if (msg.arg_count() != 0) {
                     fatal_error("Incorrect number or type of arguments to '!//'.");
                 }
                 eval_id = 0;
             } else {
-                if (args.size() != 1 || !args[0].is<double>()) {
+                if (msg.arg_count() != 1 || !msg.arg_is<double>(0)) {
                     fatal_error("Incorrect number or type of arguments to '!/'.");
                 }
-                eval_id = static_cast<message_id>(args[0].get<double>());
+                eval_id = static_cast<message_id>(msg.arg<double>(0));
             }
 
             std::lock_guard<std::mutex> lock(eval_stack_mutex);
@@ -722,23 +1124,54 @@ namespace rhost {
 
         void handle_pending_evals() {
             for (;;) {
-                message msg;
+                queued_eval eval;
                 {
                     std::lock_guard<std::mutex> lock(eval_requests_mutex);
-                    if (eval_requests.empty()) {
+                    auto queue = std::find_if(std::begin(eval_requests), std::end(eval_requests),
+                        [](const std::deque<queued_eval>& q) { return !q.empty(); });
+                    if (queue == std::end(eval_requests)) {
                         break;
-                    } else {
-                        msg = eval_requests.front();
-                        eval_requests.pop();
                     }
+
+                    eval = std::move(queue->front());
+                    queue->pop_front();
                 }
 
-                handle_eval(msg);
+                --stats::eval_queue_depth;
+                stats::eval_queue_wait.record_since(eval.received);
+
+                // The response has been sent by the time the handler returns or throws.
+                SCOPE_WARDEN(record_round_trip, {
+                    stats::eval_round_trip.record_since(eval.received);
+                });
+
+                if (eval.msg.name()[2] == '*') {
+                    handle_eval_batch(eval.msg, eval.received);
+                } else {
+                    handle_eval(eval.msg, eval.received);
+                }
             }
         }
 
-        inline message send_request_and_get_response(const std::string& name, const picojson::array& args) {
-            assert(name[0] == '?');
+        message send_request_and_get_response(const std::string& name, const picojson::array& args) {
+            message_builder builder(message::request_marker, name);
+            json::writer& writer = builder.json();
+            writer.begin_array();
+            for (const auto& arg : args) {
+                writer.write_value(arg);
+            }
+            writer.end_array();
+            return send_request_and_get_response(builder.finish());
+        }
+
+        message send_json_request_and_get_response(const std::string& name, const std::string& json) {
+            message_builder builder(message::request_marker, name, json.size());
+            builder.raw_json(json);
+            return send_request_and_get_response(builder.finish());
+        }
+
+        message send_request_and_get_response(message&& request) {
+            assert(request.name()[0] == '?');
 
             if (!transport::is_connected()) {
                 Rf_error("send_request_and_get_response not available: host already disconnected from client");
@@ -751,9 +1184,9 @@ namespace rhost {
                 response_state = RESPONSE_EXPECTED;
             }
 
-            message request(message::request_marker, name, args, blob());
-            transport::send_message(request);
             auto id = request.id();
+            std::string name = request.name();
+            transport::send_message(std::move(request));
 
             shutdown_if_requested();
 
@@ -800,14 +1233,14 @@ namespace rhost {
                         is_waiting_for_wm = false;
                         R_ProcessEvents();
 #else
-                        // Throttle polling on Unix platforms
-                        usleep(2000);
-
                         if (ptr_R_ProcessEvents != nullptr) {
                             ptr_R_ProcessEvents();
                         }
 
-                        fd_set* what = R_checkActivity(0, 1);                        
+                        // Block until there's activity on one of the input handlers - which includes the wakeup
+                        // fd signaled by unblock_message_loop - or until it's time to process events again.
+                        int timeout_usec = R_wait_usec > 0 ? std::min(R_wait_usec, message_loop_timeout_usec) : message_loop_timeout_usec;
+                        fd_set* what = R_checkActivity(timeout_usec, 1);
                         is_waiting_for_wm = false;
 #ifdef __APPLE__ 
                         if (what != NULL) {
@@ -845,12 +1278,20 @@ namespace rhost {
             }
         }
 
-        picojson::array get_context() {
-            picojson::array context;
+        // Placeholder for the R context stack argument; it is written directly into the outgoing
+        // message by the overload below, without building an intermediate picojson::array.
+        struct r_context {};
+
+        r_context get_context() {
+            return r_context();
+        }
+
+        void write_arg(json::writer& writer, r_context) {
+            writer.begin_array();
             for (RCNTXT* ctxt = reinterpret_cast<RCNTXT*>(R_GlobalContext); ctxt != nullptr; ctxt = ctxt->nextcontext) {
-                context.push_back(picojson::value(double(ctxt->callflag)));
+                writer.write_number(double(ctxt->callflag));
             }
-            return context;
+            writer.end_array();
         }
 
         void do_r_callback(bool allow_eval_interrupt) {
@@ -858,6 +1299,8 @@ namespace rhost {
 
             reset_idle_timer();
 
+            profiler::sample_if_due();
+
             // Called periodically by R_ProcessEvents and Rf_eval. This is where we check for various
             // cancellation requests and issue an interrupt (Rf_onintr) if one is applicable in the
             // current context.
@@ -890,6 +1333,19 @@ namespace rhost {
             do_r_callback(true);
         }
 
+#ifndef _WIN32
+        void (*chained_ProcessEvents)() = nullptr;
+
+        // CallBack is Windows-only, and on POSIX, the only host callback that R invokes periodically during
+        // evaluation is R_ProcessEvents (via R_CheckUserInterrupt), so profiler samples are taken there.
+        extern "C" void ProcessEvents() {
+            profiler::sample_if_due();
+            if (chained_ProcessEvents != nullptr) {
+                chained_ProcessEvents();
+            }
+        }
+#endif
+
 
         extern "C" int R_ReadConsole(const char* prompt, ReadConsole_buf_t* buf, int len, int addToHistory) {
             return with_cancellation([&] {
@@ -954,26 +1410,26 @@ namespace rhost {
                 readconsole_done();
 
                 for (std::string retry_reason;;) {
+                    auto request_start = std::chrono::steady_clock::now();
                     auto msg = send_request_and_get_response(
                         "?>", get_context(), double(len), addToHistory != 0,
                         retry_reason.empty() ? picojson::value() : picojson::value(retry_reason),
                         to_utf8_json(prompt));
+                    stats::read_console_round_trip.record_since(request_start);
 
-                    auto args = msg.json();
-                    if (args.size() != 1) {
+                    if (msg.arg_count() != 1) {
                         fatal_error("ReadConsole: response must have a single argument.");
                     }
 
-                    const auto& arg = args[0];
-                    if (arg.is<picojson::null>()) {
+                    if (msg.arg_is<picojson::null>(0)) {
                         return 0;
                     }
 
-                    if (!arg.is<std::string>()) {
+                    if (!msg.arg_is<std::string>(0)) {
                         fatal_error("ReadConsole: response argument must be string or null.");
                     }
 
-                    auto s = from_utf8(arg.get<std::string>());
+                    auto s = from_utf8(msg.arg<boost::string_view>(0));
                     if (s.size() >= static_cast<size_t>(len)) {
                         retry_reason = "BUFFER_OVERFLOW";
                         continue;
@@ -987,7 +1443,12 @@ namespace rhost {
 
         extern "C" void WriteConsoleEx(const char* buf, int len, int otype) {
             with_cancellation([&] {
-                send_notification((otype ? "!!" : "!"), to_utf8_json(buf));
+                if (!buf) {
+                    return;
+                }
+
+                reset_idle_timer();
+                transport::send_console_output(otype != 0, Rchar_to_utf8(buf));
             });
         }
 
@@ -997,9 +1458,14 @@ namespace rhost {
             });
         }
 
-        void message_received(const message& incoming) {
+        void message_received(message& incoming) {
             reset_idle_timer();
 
+            // Answered right away, even before R is ready, since it's meant for checking on the host itself.
+            if (!strcmp(incoming.name(), "?Stats")) {
+                return get_stats(incoming);
+            }
+
             // If R is not ready yet, wait until it is before processing any incoming requests
             // to avoid racing with R initialization code.
             {
@@ -1024,9 +1490,18 @@ namespace rhost {
                 return write_blob(incoming);
             } else if (name == "!DestroyBlob") {
                 return destroy_blobs(incoming);
+            } else if (name == "!StartProfiler") {
+                return start_profiler(incoming);
+            } else if (name == "!StopProfiler") {
+                return profiler::stop();
+            } else if (name == "?GetProfile") {
+                return get_profile(incoming);
             } else if (name.size() >= 2 && name[0] == '?' && name[1] == '=') {
+                auto received = std::chrono::steady_clock::now();
+                auto priority = get_eval_priority(incoming.name());
                 std::lock_guard<std::mutex> lock(eval_requests_mutex);
-                eval_requests.push(incoming);
+                eval_requests[priority].push_back(queued_eval{ std::move(incoming), received });
+                ++stats::eval_queue_depth;
                 unblock_message_loop();
                 return;
             } else if (incoming.is_response()) {
@@ -1061,6 +1536,8 @@ namespace rhost {
             ptr_R_WriteConsoleEx = WriteConsoleEx;
             ptr_R_ShowMessage = ShowMessage;
             ptr_R_Busy = Busy;
+            chained_ProcessEvents = ptr_R_ProcessEvents;
+            ptr_R_ProcessEvents = ProcessEvents;
         }
 #endif
 
@@ -1068,6 +1545,8 @@ namespace rhost {
             host::rdata = rdata;
 #ifdef _WIN32
             main_thread_id = GetCurrentThreadId();
+#else
+            create_wakeup_fd();
 #endif
             transport::message_received.connect(message_received);
             transport::disconnected.connect(unblock_message_loop);
@@ -1101,12 +1580,11 @@ namespace rhost {
                 }
 
                 auto msg = send_request_and_get_response(cmd, get_context(), to_utf8_json(s));
-                auto args = msg.json();
-                if (args.size() != 1 || !args[0].is<std::string>()) {
+                if (msg.arg_count() != 1 || !msg.arg_is<std::string>(0)) {
                     fatal_error("ShowMessageBox: response argument must be a string.");
                 }
 
-                auto& r = args[0].get<std::string>();
+                auto r = msg.arg<boost::string_view>(0);
                 if (r == "N") {
                     return -1; // graphapp.h => NO
                 } else if (r == "C") {
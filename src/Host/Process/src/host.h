@@ -60,48 +60,42 @@ namespace rhost {
             }
         }
 
+        // Sends a notification that was built with protocol::message_builder.
+        protocol::message_id send_notification(protocol::message&& msg);
+
         protocol::message_id send_notification(const std::string& name, const picojson::array& args, const blobs::blob& blob = blobs::blob());
 
+        // Same as above, but arguments are already serialized to JSON text, which must be an array.
+        protocol::message_id send_json_notification(const std::string& name, const std::string& json, const blobs::blob& blob = blobs::blob());
+
+        // Arguments are written as JSON directly into the payload; see json::write_args.
         template<class... Args>
         inline protocol::message_id send_notification(const std::string& name, const Args&... args) {
-            picojson::array args_array;
-            rhost::util::append(args_array, args...);
-            return send_notification(name, args_array);
+            protocol::message_builder builder(0, name);
+            builder.args(args...);
+            return send_notification(builder.finish());
         }
 
         template<class... Args>
         inline protocol::message_id send_notification(const std::string& name, const blobs::blob& blob, const Args&... args) {
-            picojson::array args_array;
-            rhost::util::append(args_array, args...);
-            return send_notification(name, args_array, blob);
+            protocol::message_builder builder(0, name, blob.size());
+            builder.args(args...);
+            return send_notification(builder.finish(blob));
         }
 
+        // Sends a request that was built with protocol::message_builder, and waits for the response.
+        protocol::message send_request_and_get_response(protocol::message&& request);
+
         protocol::message send_request_and_get_response(const std::string&, const picojson::array& args);
 
+        // Same as above, but arguments are already serialized to JSON text, which must be an array.
+        protocol::message send_json_request_and_get_response(const std::string& name, const std::string& json);
+
         template<class... Args>
         inline protocol::message send_request_and_get_response(const std::string& name, const Args&... args) {
-            picojson::array args_array;
-            rhost::util::append(args_array, args...);
-            return send_request_and_get_response(name, args_array);
-        }
-
-        blobs::blob_id create_blob(blobs::blob&& blob);
-
-        inline blobs::blob_id create_blob(const blobs::blob& blob) {
-            auto copy = blob;
-            return create_blob(copy);
-        }
-
-        bool get_blob(blobs::blob_id id, blobs::blob& blob);
-
-        inline blobs::blob get_blob(blobs::blob_id id) {
-            blobs::blob blob;
-            if (!get_blob(id, blob)) {
-                log::fatal_error("GetBlob: no blob with ID %lld", id);
-            }
-            return blob;
+            protocol::message_builder builder(protocol::message::request_marker, name);
+            builder.args(args...);
+            return send_request_and_get_response(builder.finish());
         }
-
-        void destroy_blob(blobs::blob_id id);
     }
 }
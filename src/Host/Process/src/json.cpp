@@ -20,26 +20,328 @@
  *
  * ***************************************************************************/
 
+#include "dtoa.h"
 #include "json.h"
 #include "log.h"
 
 using namespace rhost::util;
 using namespace rhost::log;
-namespace js = picojson;
 
 namespace rhost {
     namespace json {
         namespace {
-            bool strsxp_to_utf8(SEXP sexp, std::string& result) {
-                const void* vmax = vmaxget();
-                const char* s = Rf_translateCharUTF8(sexp);
-                if (s) {
-                    result = s;
+            const char hex_digits[] = "0123456789abcdef";
+
+            // Characters that picojson escapes as \uXXXX: control characters and DEL.
+            inline bool needs_unicode_escape(unsigned char c) {
+                return c < 0x20 || c == 0x7f;
+            }
+
+#ifdef RHOST_SSE2
+            // Index of the lowest set bit in a non-zero mask.
+            inline unsigned first_set_bit(unsigned mask) {
+#ifdef _MSC_VER
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return index;
+#else
+                return __builtin_ctz(mask);
+#endif
+            }
+#endif
+
+            // Returns a pointer to the first character in [p, end) that must be escaped, or end if there's none.
+            inline const char* find_escape(const char* p, const char* end) {
+#ifdef RHOST_SSE2
+                // Check 16 bytes at a time; most strings have no escapes at all, or long runs between them.
+                const __m128i quote = _mm_set1_epi8('"');
+                const __m128i backslash = _mm_set1_epi8('\\');
+                const __m128i slash = _mm_set1_epi8('/');
+                const __m128i del = _mm_set1_epi8(0x7f);
+                const __m128i max_control = _mm_set1_epi8(0x1f);
+
+                for (; end - p >= 16; p += 16) {
+                    __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                    __m128i matches = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(chars, quote), _mm_cmpeq_epi8(chars, backslash)),
+                        _mm_or_si128(_mm_cmpeq_epi8(chars, slash), _mm_cmpeq_epi8(chars, del)));
+                    // Unsigned c <= 0x1f is the same as max(c, 0x1f) == 0x1f.
+                    matches = _mm_or_si128(matches, _mm_cmpeq_epi8(_mm_max_epu8(chars, max_control), max_control));
+
+                    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(matches));
+                    if (mask != 0) {
+                        return p + first_set_bit(mask);
+                    }
+                }
+#endif
+
+                for (; p != end; ++p) {
+                    unsigned char c = static_cast<unsigned char>(*p);
+                    if (c == '"' || c == '\\' || c == '/' || needs_unicode_escape(c)) {
+                        break;
+                    }
+                }
+                return p;
+            }
+
+            // Returns a pointer to the first character in [p, end) that ends a run of characters within a JSON
+            // string: a quote, a backslash, or a control character (which is not valid there), or end.
+            inline const char* find_string_special(const char* p, const char* end) {
+#ifdef RHOST_SSE2
+                const __m128i quote = _mm_set1_epi8('"');
+                const __m128i backslash = _mm_set1_epi8('\\');
+                const __m128i max_control = _mm_set1_epi8(0x1f);
+
+                for (; end - p >= 16; p += 16) {
+                    __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                    __m128i matches = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(chars, quote), _mm_cmpeq_epi8(chars, backslash)),
+                        _mm_cmpeq_epi8(_mm_max_epu8(chars, max_control), max_control));
+
+                    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(matches));
+                    if (mask != 0) {
+                        return p + first_set_bit(mask);
+                    }
+                }
+#endif
+
+                for (; p != end; ++p) {
+                    unsigned char c = static_cast<unsigned char>(*p);
+                    if (c == '"' || c == '\\' || c < 0x20) {
+                        break;
+                    }
+                }
+                return p;
+            }
+
+            // Returns a pointer to the first character in [p, end) that starts a string, or opens or closes
+            // an array or an object, or end if there's none.
+            inline const char* find_structural(const char* p, const char* end) {
+#ifdef RHOST_SSE2
+                const __m128i quote = _mm_set1_epi8('"');
+                const __m128i open_bracket = _mm_set1_epi8('[');
+                const __m128i close_bracket = _mm_set1_epi8(']');
+                const __m128i open_brace = _mm_set1_epi8('{');
+                const __m128i close_brace = _mm_set1_epi8('}');
+
+                for (; end - p >= 16; p += 16) {
+                    __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                    __m128i matches = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(chars, open_bracket), _mm_cmpeq_epi8(chars, close_bracket)),
+                        _mm_or_si128(_mm_cmpeq_epi8(chars, open_brace), _mm_cmpeq_epi8(chars, close_brace)));
+                    matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chars, quote));
+
+                    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(matches));
+                    if (mask != 0) {
+                        return p + first_set_bit(mask);
+                    }
+                }
+#endif
+
+                for (; p != end; ++p) {
+                    char c = *p;
+                    if (c == '"' || c == '[' || c == ']' || c == '{' || c == '}') {
+                        break;
+                    }
+                }
+                return p;
+            }
+
+            inline const char* skip_whitespace(const char* p, const char* end) {
+                while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+                    ++p;
+                }
+                return p;
+            }
+
+            // Given a pointer to the opening quote of a string, returns a pointer past its closing quote, or
+            // nullptr if the string is not terminated, or contains a control character.
+            const char* skip_string(const char* p, const char* end) {
+                for (++p;;) {
+                    p = find_string_special(p, end);
+                    if (p == end || static_cast<unsigned char>(*p) < 0x20) {
+                        return nullptr;
+                    }
+                    if (*p == '"') {
+                        return p + 1;
+                    }
+
+                    // Backslash - skip it together with the next character, so that \" does not end the string.
+                    if (end - p < 2) {
+                        return nullptr;
+                    }
+                    p += 2;
+                }
+            }
+
+            // Given a pointer to the opening bracket of an array or object, returns a pointer past the matching
+            // closing bracket, or nullptr if brackets are unbalanced.
+            const char* skip_container(const char* p, const char* end) {
+                std::string closing;
+                for (;;) {
+                    switch (*p) {
+                    case '"':
+                        p = skip_string(p, end);
+                        if (!p) {
+                            return nullptr;
+                        }
+                        p = find_structural(p, end);
+                        break;
+                    case '[':
+                    case '{':
+                        closing.push_back(*p == '[' ? ']' : '}');
+                        p = find_structural(p + 1, end);
+                        break;
+                    default:
+                        if (*p != closing.back()) {
+                            return nullptr;
+                        }
+                        closing.pop_back();
+                        if (closing.empty()) {
+                            return p + 1;
+                        }
+                        p = find_structural(p + 1, end);
+                        break;
+                    }
+
+                    if (p == end) {
+                        return nullptr;
+                    }
+                }
+            }
+
+            // Given a pointer to the first character of a JSON value, returns a pointer past its last character,
+            // or nullptr if it is obviously malformed. Literals and numbers are not validated.
+            const char* skip_value(const char* p, const char* end) {
+                switch (*p) {
+                case '"':
+                    return skip_string(p, end);
+                case '[':
+                case '{':
+                    return skip_container(p, end);
+                default:
+                    const char* start = p;
+                    while (p != end && *p != ',' && *p != ']' && *p != '}' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+                        ++p;
+                    }
+                    return p == start ? nullptr : p;
+                }
+            }
+
+            // Parses 4 hex digits of a \uXXXX escape, or returns -1 if they're malformed.
+            int parse_quadhex(const char*& p, const char* end) {
+                if (end - p < 4) {
+                    return -1;
+                }
+
+                int result = 0;
+                for (int i = 0; i < 4; ++i) {
+                    char c = *p++;
+                    int digit;
+                    if (c >= '0' && c <= '9') {
+                        digit = c - '0';
+                    } else if (c >= 'A' && c <= 'F') {
+                        digit = c - 'A' + 10;
+                    } else if (c >= 'a' && c <= 'f') {
+                        digit = c - 'a' + 10;
+                    } else {
+                        return -1;
+                    }
+                    result = (result << 4) | digit;
+                }
+                return result;
+            }
+
+            // Decodes a \uXXXX escape (and the one that follows it, if it's a surrogate pair) as UTF-8, same as
+            // picojson does. p points after "\u", and is moved past the escape; out is moved past the output,
+            // which is never longer than the escape.
+            bool parse_codepoint(const char*& p, const char* end, char*& out) {
+                int cp = parse_quadhex(p, end);
+                if (cp == -1) {
+                    return false;
+                }
+
+                if (cp >= 0xd800 && cp <= 0xdfff) {
+                    if (cp >= 0xdc00) {
+                        return false;
+                    }
+                    if (end - p < 2 || p[0] != '\\' || p[1] != 'u') {
+                        return false;
+                    }
+                    p += 2;
+                    int low = parse_quadhex(p, end);
+                    if (low < 0xdc00 || low > 0xdfff) {
+                        return false;
+                    }
+                    cp = 0x10000 + (((cp - 0xd800) << 10) | (low - 0xdc00));
+                }
+
+                if (cp < 0x80) {
+                    *out++ = static_cast<char>(cp);
+                } else if (cp < 0x800) {
+                    *out++ = static_cast<char>(0xc0 | (cp >> 6));
+                    *out++ = static_cast<char>(0x80 | (cp & 0x3f));
+                } else if (cp < 0x10000) {
+                    *out++ = static_cast<char>(0xe0 | (cp >> 12));
+                    *out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+                    *out++ = static_cast<char>(0x80 | (cp & 0x3f));
                 } else {
-                    result.clear();
+                    *out++ = static_cast<char>(0xf0 | (cp >> 18));
+                    *out++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+                    *out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+                    *out++ = static_cast<char>(0x80 | (cp & 0x3f));
+                }
+                return true;
+            }
+
+            // Unescapes the contents of a JSON string literal [p, end), excluding quotes, into out, which must
+            // have room for end - p characters. Returns the end of output, or nullptr if the string is malformed.
+            char* unescape_string(const char* p, const char* end, char* out) {
+                for (;;) {
+                    const char* special = find_string_special(p, end);
+                    memcpy(out, p, special - p);
+                    out += special - p;
+                    if (special == end) {
+                        return out;
+                    }
+                    if (*special != '\\' || end - special < 2) {
+                        return nullptr;
+                    }
+
+                    p = special + 2;
+                    switch (special[1]) {
+                    case '"': *out++ = '"'; break;
+                    case '\\': *out++ = '\\'; break;
+                    case '/': *out++ = '/'; break;
+                    case 'b': *out++ = '\b'; break;
+                    case 'f': *out++ = '\f'; break;
+                    case 'n': *out++ = '\n'; break;
+                    case 'r': *out++ = '\r'; break;
+                    case 't': *out++ = '\t'; break;
+                    case 'u':
+                        if (!parse_codepoint(p, end, out)) {
+                            return nullptr;
+                        }
+                        break;
+                    default:
+                        return nullptr;
+                    }
+                }
+            }
+
+            // Returns the character that follows the backslash in a short escape sequence, or 0 if there's none.
+            inline char short_escape(char c) {
+                switch (c) {
+                case '"': return '"';
+                case '\\': return '\\';
+                case '/': return '/';
+                case '\b': return 'b';
+                case '\f': return 'f';
+                case '\n': return 'n';
+                case '\r': return 'r';
+                case '\t': return 't';
+                default: return 0;
                 }
-                vmaxset(vmax);
-                return s != nullptr;
             }
 
             void json_error(SEXP sexp, const char* format, ...) {
@@ -59,164 +361,508 @@ namespace rhost {
                 Rf_error("%s", buf);
             }
 
-            void at_most_one(SEXP sexp) {
-                if (Rf_length(sexp) != 1) {
-                    json_error(sexp, "Vector must have 0 or 1 elements.");
+            // Largest buffer needed by format_* functions.
+            const size_t number_buffer_size = dtoa::max_length;
+
+            // Formats an integer into the end of the buffer, and returns a pointer to the first character.
+            inline char* format_int(int64_t value, char* end) {
+                char* p = end;
+
+                // Negate in unsigned arithmetic, so that the minimal value doesn't overflow.
+                uint64_t n = value < 0 ? 0u - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+                do {
+                    *--p = static_cast<char>('0' + n % 10);
+                    n /= 10;
+                } while (n != 0);
+                if (value < 0) {
+                    *--p = '-';
+                }
+
+                return p;
+            }
+
+            // Formats a finite double into a buffer of number_buffer_size, and returns a pointer to the first
+            // character; end is the end of the buffer. Integral values are formatted same as picojson does;
+            // all others use the shortest representation that round-trips, rather than picojson's "%.17g".
+            char* format_double(double value, char* buf, char*& end) {
+                // Integral values that fit into the mantissa are printed with "%.f" by picojson, which is
+                // just the digits of the integer - except for negative zero, which it prints as "-0".
+                if (fabs(value) < (1ULL << 53) && value == static_cast<double>(static_cast<int64_t>(value))) {
+                    end = buf + number_buffer_size;
+                    if (value == 0 && std::signbit(value)) {
+                        end[-1] = '0';
+                        end[-2] = '-';
+                        return end - 2;
+                    }
+                    return format_int(static_cast<int64_t>(value), end);
+                }
+
+                end = dtoa::format_shortest(value, buf);
+                return buf;
+            }
+
+            // Writes a CHARSXP as a JSON string. Returns false, and writes nothing, if it could not be
+            // converted to UTF-8.
+            bool write_charsxp(writer& writer, SEXP charsxp) {
+                const void* vmax = vmaxget();
+                const char* s = Rf_translateCharUTF8(charsxp);
+                if (s) {
+                    writer.write_string(s, strlen(s));
+                }
+                vmaxset(vmax);
+                return s != nullptr;
+            }
+
+            bool charsxp_to_utf8(SEXP sexp, std::string& result) {
+                const void* vmax = vmaxget();
+                const char* s = Rf_translateCharUTF8(sexp);
+                if (s) {
+                    result = s;
+                } else {
+                    result.clear();
+                }
+                vmaxset(vmax);
+                return s != nullptr;
+            }
+
+            // Writes the members of an object in the order of their names, same as picojson::object would.
+            // members is a list of (name, value) pairs, in their original order. A member with the same name
+            // as a member that follows it is reported as an error, unless its value is NA (and thus skipped).
+            void write_members(writer& writer, SEXP sexp, std::vector<std::pair<std::string, SEXP>>& members, const char* container) {
+                std::stable_sort(members.begin(), members.end(), [](const std::pair<std::string, SEXP>& x, const std::pair<std::string, SEXP>& y) {
+                    return x.first < y.first;
+                });
+
+                writer.begin_object();
+                for (size_t i = 0; i < members.size(); ++i) {
+                    auto& member = members[i];
+
+                    size_t pos = writer.position();
+                    writer.write_key(member.first);
+                    if (!to_json(member.second, writer)) {
+                        writer.rewind(pos);
+                    } else if (i + 1 < members.size() && members[i + 1].first == member.first) {
+                        json_error(sexp, "Duplicate name '%s' in %s.", member.first.c_str(), container);
+                    }
                 }
+                writer.end_object();
             }
 
-            void list_to_array(SEXP sexp, js::array& result) {
+            void list_to_array(SEXP sexp, writer& writer) {
                 R_len_t count = Rf_length(sexp);
-                result.reserve(count);
 
+                writer.begin_array();
                 for (R_len_t i = 0; i < count; ++i) {
-                    result.push_back(js::value());
-                    auto& elem = result.back();
-
+                    size_t pos = writer.position();
                     SEXP elem_sexp = VECTOR_ELT(sexp, i);
-                    if (!to_json(elem_sexp, elem)) {
-                        result.pop_back();
+                    if (!to_json(elem_sexp, writer)) {
+                        writer.rewind(pos);
                     }
                 }
+                writer.end_array();
             }
 
-            void list_to_object(SEXP sexp, SEXP names, js::object& result) {
+            void list_to_object(SEXP sexp, SEXP names, writer& writer) {
                 R_len_t count = Rf_length(sexp);
                 if (Rf_length(names) != count) {
                     json_error(sexp, "All elements in list must be named, but there are fewer names than elements.");
                 }
 
+                std::vector<std::pair<std::string, SEXP>> members(count);
                 for (R_len_t i = 0; i < count; ++i) {
                     SEXP name_sexp = STRING_ELT(names, i);
                     if (name_sexp == R_NaString) {
                         json_error(sexp, "All elements in list must be named, but [[%d]] is not.", i + 1);
                     }
 
-                    std::string name;
-                    if (!strsxp_to_utf8(name_sexp, name)) {
+                    if (!charsxp_to_utf8(name_sexp, members[i].first)) {
                         json_error(sexp, "Name of [[%d]] could not be converted to UTF-8.", i + 1);
                     }
 
-                    auto insert_result = result.insert(std::make_pair(name, js::value()));
-                    if (!insert_result.second) {
-                        json_error(sexp, "Duplicate name '%s' in list.", name.c_str());
-                    }
-
-                    auto iter = insert_result.first;
-                    auto& elem = iter->second;
-
-                    SEXP elem_sexp = VECTOR_ELT(sexp, i);
-                    if (!to_json(elem_sexp, elem)) {
-                        result.erase(iter);
-                    }
+                    members[i].second = VECTOR_ELT(sexp, i);
                 }
+
+                write_members(writer, sexp, members, "list");
             }
 
-            void env_to_object(SEXP sexp, js::object& result) {
+            void env_to_object(SEXP sexp, writer& writer) {
                 SEXP names = R_lsInternal3(sexp, R_TRUE, R_FALSE);
                 R_len_t count = Rf_length(names);
 
+                std::vector<std::pair<std::string, SEXP>> members(count);
                 for (R_len_t i = 0; i < count; ++i) {
                     SEXP name_sexp = STRING_ELT(names, i);
-                    std::string name;
-                    if (!strsxp_to_utf8(name_sexp, name)) {
+                    if (!charsxp_to_utf8(name_sexp, members[i].first)) {
                         json_error(sexp, "Name of [[%d]] could not be converted to UTF-8.", i + 1);
                     }
 
-                    auto insert_result = result.insert(std::make_pair(name, js::value()));
-                    if (!insert_result.second) {
-                        json_error(sexp, "Duplicate name '%s' in environment.", name.c_str());
+                    SEXP sym_sexp = Rf_installChar(name_sexp);
+                    members[i].second = Rf_findVar(sym_sexp, sexp);
+                }
+
+                write_members(writer, sexp, members, "environment");
+            }
+        }
+
+        void writer::write_number(double value) {
+            separate();
+            char buf[number_buffer_size], *end;
+            char* start = format_double(value, buf, end);
+            _buffer.append(start, end);
+        }
+
+        void writer::write_number(int value) {
+            separate();
+            char buf[number_buffer_size];
+            char* end = buf + sizeof buf;
+            _buffer.append(format_int(value, end), end);
+        }
+
+        void writer::write_string(const char* s, size_t len) {
+            separate();
+            _buffer.push_back('"');
+
+            // Copy runs of characters that need no escaping all at once.
+            const char* end = s + len;
+            for (;;) {
+                const char* p = find_escape(s, end);
+                _buffer.append(s, p);
+                if (p == end) {
+                    break;
+                }
+
+                char c = *p;
+                char esc = short_escape(c);
+                if (esc) {
+                    char seq[2] = { '\\', esc };
+                    _buffer.append(seq, 2);
+                } else {
+                    unsigned char u = static_cast<unsigned char>(c);
+                    char seq[6] = { '\\', 'u', '0', '0', hex_digits[u >> 4], hex_digits[u & 0xF] };
+                    _buffer.append(seq, 6);
+                }
+                s = p + 1;
+            }
+
+            _buffer.push_back('"');
+        }
+
+        namespace {
+            // Vectors are written in a single pass, with elements formatted straight into the buffer; there is
+            // no per-element dispatch on type, and no separator logic other than a comma between elements.
+            // NA elements are written as null, so that positions of other elements are preserved.
+
+            void logical_vector_to_json(SEXP sexp, writer& writer) {
+                R_xlen_t count = Rf_xlength(sexp);
+                const int* data = LOGICAL(sexp);
+                const int na = R_NaInt;
+
+                std::string& buffer = writer.buffer();
+                writer.begin_array();
+                buffer.reserve(buffer.size() + count * 6 + 1);
+                for (R_xlen_t i = 0; i < count; ++i) {
+                    if (i != 0) {
+                        buffer.push_back(',');
+                    }
+
+                    int x = data[i];
+                    if (x == na) {
+                        buffer.append("null", 4);
+                    } else if (x) {
+                        buffer.append("true", 4);
+                    } else {
+                        buffer.append("false", 5);
                     }
+                }
+                writer.end_array();
+            }
 
-                    auto iter = insert_result.first;
-                    auto& elem = iter->second;
+            void integer_vector_to_json(SEXP sexp, writer& writer) {
+                R_xlen_t count = Rf_xlength(sexp);
+                const int* data = INTEGER(sexp);
+                const int na = R_NaInt;
 
-                    SEXP sym_sexp = Rf_installChar(name_sexp);
-                    SEXP elem_sexp = Rf_findVar(sym_sexp, sexp);
-                    if (!to_json(elem_sexp, elem)) {
-                        result.erase(iter);
+                std::string& buffer = writer.buffer();
+                writer.begin_array();
+                buffer.reserve(buffer.size() + count * 4 + 1);
+
+                char buf[number_buffer_size];
+                char* end = buf + sizeof buf;
+                for (R_xlen_t i = 0; i < count; ++i) {
+                    if (i != 0) {
+                        buffer.push_back(',');
+                    }
+
+                    int x = data[i];
+                    if (x == na) {
+                        buffer.append("null", 4);
+                    } else {
+                        buffer.append(format_int(x, end), end);
+                    }
+                }
+                writer.end_array();
+            }
+
+            void real_vector_to_json(SEXP sexp, writer& writer) {
+                R_xlen_t count = Rf_xlength(sexp);
+                const double* data = REAL(sexp);
+
+                std::string& buffer = writer.buffer();
+                writer.begin_array();
+                buffer.reserve(buffer.size() + count * 8 + 1);
+
+                char buf[number_buffer_size], *end;
+                for (R_xlen_t i = 0; i < count; ++i) {
+                    if (i != 0) {
+                        buffer.push_back(',');
+                    }
+
+                    double x = data[i];
+                    if (!std::isfinite(x)) {
+                        // NA is a NaN with a special payload, so only non-finite values need the R_IsNA check.
+                        if (!std::isnan(x) || !R_IsNA(x)) {
+                            json_error(sexp, "+Inf, -Inf and NaN cannot be serialized.");
+                        }
+                        buffer.append("null", 4);
+                    } else {
+                        char* start = format_double(x, buf, end);
+                        buffer.append(start, end);
                     }
                 }
+                writer.end_array();
             }
+
+            void string_vector_to_json(SEXP sexp, writer& writer) {
+                R_xlen_t count = Rf_xlength(sexp);
+
+                writer.begin_array();
+                for (R_xlen_t i = 0; i < count; ++i) {
+                    SEXP x = STRING_ELT(sexp, i);
+                    if (x == R_NaString || !write_charsxp(writer, x)) {
+                        writer.write_null();
+                    }
+                }
+                writer.end_array();
+            }
+        }
+
+        void writer::write_value(const picojson::value& value) {
+            separate();
+            value.serialize(std::back_inserter(_buffer));
         }
 
-        bool to_json(SEXP sexp, js::value& result) {
+        std::string array_index::parse(const char* text, size_t size) {
+            const char* end = text + size;
+            _elements.clear();
+
+            const char* p = skip_whitespace(text, end);
+            if (p == end || *p != '[') {
+                return "JSON payload must be an array";
+            }
+
+            p = skip_whitespace(p + 1, end);
+            if (p != end && *p == ']') {
+                return std::string();
+            }
+
+            for (;;) {
+                if (p == end) {
+                    return "unexpected end of array";
+                }
+
+                const char* elem_end = skip_value(p, end);
+                if (!elem_end) {
+                    return "malformed element [" + std::to_string(_elements.size()) + "]";
+                }
+                _elements.emplace_back(p, elem_end);
+
+                p = skip_whitespace(elem_end, end);
+                if (p == end) {
+                    return "unexpected end of array";
+                } else if (*p == ']') {
+                    return std::string();
+                } else if (*p != ',') {
+                    return "expected ',' or ']' after element [" + std::to_string(_elements.size() - 1) + "]";
+                }
+                p = skip_whitespace(p + 1, end);
+            }
+        }
+
+        template <>
+        picojson::value array_index::get<picojson::value>(size_t i) const {
+            if (is<std::string>(i)) {
+                return picojson::value(get<std::string>(i));
+            }
+
+            const char* begin = _elements[i].first;
+            const char* end = _elements[i].second;
+
+            picojson::value result;
+            std::string err;
+            const char* parsed_end = picojson::parse(result, begin, end, &err);
+            if (!err.empty() || parsed_end != end) {
+                log::fatal_error("Malformed JSON in element [%zu] - %s: %s", i, err.c_str(), text(i).c_str());
+            }
+            return result;
+        }
+
+        template <>
+        bool array_index::get<bool>(size_t i) const {
+            auto value = get<picojson::value>(i);
+            if (!value.is<bool>()) {
+                log::fatal_error("Element [%zu] must be a boolean: %s", i, text(i).c_str());
+            }
+            return value.get<bool>();
+        }
+
+        template <>
+        double array_index::get<double>(size_t i) const {
+            auto value = get<picojson::value>(i);
+            if (!value.is<double>()) {
+                log::fatal_error("Element [%zu] must be a number: %s", i, text(i).c_str());
+            }
+            return value.get<double>();
+        }
+
+        template <>
+        std::string array_index::get<std::string>(size_t i) const {
+            if (!is<std::string>(i)) {
+                log::fatal_error("Element [%zu] must be a string: %s", i, text(i).c_str());
+            }
+
+            const char* begin = _elements[i].first + 1;
+            const char* end = _elements[i].second - 1;
+
+            std::string result(end - begin, '\0');
+            char* result_end = begin == end ? &result[0] : unescape_string(begin, end, &result[0]);
+            if (!result_end) {
+                log::fatal_error("Malformed JSON string in element [%zu]: %s", i, text(i).c_str());
+            }
+            result.resize(result_end - result.data());
+            return result;
+        }
+
+        boost::string_view array_index::get_string(size_t i, util::arena& arena) const {
+            if (!is<std::string>(i)) {
+                log::fatal_error("Element [%zu] must be a string: %s", i, text(i).c_str());
+            }
+
+            const char* begin = _elements[i].first + 1;
+            const char* end = _elements[i].second - 1;
+            if (find_string_special(begin, end) == end) {
+                return boost::string_view(begin, end - begin);
+            }
+
+            char* result = arena.allocate_chars(end - begin);
+            char* result_end = unescape_string(begin, end, result);
+            if (!result_end) {
+                log::fatal_error("Malformed JSON string in element [%zu]: %s", i, text(i).c_str());
+            }
+            return boost::string_view(result, result_end - result);
+        }
+
+        picojson::array array_index::to_array() const {
+            picojson::array result;
+            result.reserve(size());
+            for (size_t i = 0; i < size(); ++i) {
+                result.push_back(get<picojson::value>(i));
+            }
+            return result;
+        }
+
+        bool to_json(SEXP sexp, writer& writer) {
             int type = TYPEOF(sexp);
 
             switch (type) {
             case NILSXP:
-                result = js::value();
+                writer.write_null();
                 return true;
 
             case VECSXP: {
                 SEXP names = Rf_getAttrib(sexp, R_NamesSymbol);
                 if (Rf_isNull(names)) {
-                    result = js::value(js::array());
-                    list_to_array(sexp, result.get<js::array>());
+                    list_to_array(sexp, writer);
                 } else {
-                    result = js::value(js::object());
-                    list_to_object(sexp, names, result.get<js::object>());
+                    list_to_object(sexp, names, writer);
                 }
                 return true;
             }
 
             case ENVSXP:
-                result = js::value(js::object());
-                env_to_object(sexp, result.get<js::object>());
+                env_to_object(sexp, writer);
                 return true;
             }
 
-            if (Rf_length(sexp) == 0) {
-                result = js::value();
+            R_xlen_t length = Rf_xlength(sexp);
+            if (length == 0) {
+                writer.write_null();
                 return true;
             }
 
+            if (length > 1) {
+                switch (type) {
+                case LGLSXP:
+                    logical_vector_to_json(sexp, writer);
+                    return true;
+                case INTSXP:
+                    integer_vector_to_json(sexp, writer);
+                    return true;
+                case REALSXP:
+                    real_vector_to_json(sexp, writer);
+                    return true;
+                case STRSXP:
+                    string_vector_to_json(sexp, writer);
+                    return true;
+                }
+            }
+
             switch (type) {
             case LGLSXP: {
-                at_most_one(sexp);
                 int x = *LOGICAL(sexp);
-                result = x == R_NaInt ? js::value() : js::value(x != 0);
-                break;
+                if (x == R_NaInt) {
+                    writer.write_null();
+                    return false;
+                }
+                writer.write_bool(x != 0);
+                return true;
             }
 
             case INTSXP: {
-                at_most_one(sexp);
                 int x = *INTEGER(sexp);
-                result = x == R_NaInt ? js::value() : js::value(static_cast<double>(x));
-                break;
+                if (x == R_NaInt) {
+                    writer.write_null();
+                    return false;
+                }
+                writer.write_number(x);
+                return true;
             }
 
             case REALSXP: {
-                at_most_one(sexp);
                 double x = *REAL(sexp);
                 if (R_IsNA(x)) {
-                    result = js::value();
-                } else {
-                    if (std::isinf(x) || std::isnan(x)) {
-                        json_error(sexp, "+Inf, -Inf and NaN cannot be serialized.");
-                    }
-                    result = js::value(x);
+                    writer.write_null();
+                    return false;
+                }
+                if (std::isinf(x) || std::isnan(x)) {
+                    json_error(sexp, "+Inf, -Inf and NaN cannot be serialized.");
                 }
-                break;
+                writer.write_number(x);
+                return true;
             }
 
             case STRSXP: {
-                at_most_one(sexp);
                 SEXP x = STRING_ELT(sexp, 0);
-                if (x == R_NaString) {
-                    result = js::value();
-                } else {
-                    std::string s;
-                    result = strsxp_to_utf8(x, s) ? js::value(s) : js::value();
+                if (x == R_NaString || !write_charsxp(writer, x)) {
+                    writer.write_null();
+                    return false;
                 }
-                break;
+                return true;
             }
 
             default:
                 json_error(sexp, "Unsupported type - must be one of: NULL; logical, integer, real, character vector; list; environment.");
+                return false;
             }
-
-            return result != js::value();
         }
     }
 }
@@ -26,6 +26,245 @@
 
 namespace rhost {
     namespace json {
+        // Writes JSON text directly into a string, without building a picojson::value first. The output
+        // is the same as that of picojson::value::serialize() for the equivalent value, except that
+        // non-integral numbers use the shortest representation that round-trips, so the two can be mixed
+        // freely. Commas are inserted automatically between array elements and object members.
+        //
+        // The buffer need not be empty; JSON is appended to whatever it already contains.
+        class writer {
+        public:
+            explicit writer(std::string& buffer) :
+                _buffer(buffer), _start(buffer.size()) {
+            }
+
+            std::string& buffer() {
+                return _buffer;
+            }
+
+            // Current position in the buffer, which can later be passed to rewind() to discard everything
+            // that was written after that point (e.g. to drop an object member after its key was written).
+            size_t position() const {
+                return _buffer.size();
+            }
+
+            void rewind(size_t position) {
+                _buffer.resize(position);
+            }
+
+            void write_null() {
+                separate();
+                _buffer.append("null", 4);
+            }
+
+            void write_bool(bool value) {
+                separate();
+                if (value) {
+                    _buffer.append("true", 4);
+                } else {
+                    _buffer.append("false", 5);
+                }
+            }
+
+            // Value must be finite.
+            void write_number(double value);
+
+            void write_number(int value);
+
+            void write_string(const char* s, size_t len);
+
+            void write_string(const std::string& s) {
+                write_string(s.data(), s.size());
+            }
+
+            void write_value(const picojson::value& value);
+
+            void begin_array() {
+                separate();
+                _buffer.push_back('[');
+            }
+
+            void end_array() {
+                _buffer.push_back(']');
+            }
+
+            void begin_object() {
+                separate();
+                _buffer.push_back('{');
+            }
+
+            void end_object() {
+                _buffer.push_back('}');
+            }
+
+            // Must be followed by a value.
+            void write_key(const char* s, size_t len) {
+                write_string(s, len);
+                _buffer.push_back(':');
+            }
+
+            void write_key(const std::string& s) {
+                write_key(s.data(), s.size());
+            }
+
+        private:
+            std::string& _buffer;
+            size_t _start;
+
+            // Writes a comma if something other than the start of an array or object, or a key, precedes.
+            void separate() {
+                if (_buffer.size() > _start) {
+                    char c = _buffer.back();
+                    if (c != '[' && c != '{' && c != ':') {
+                        _buffer.push_back(',');
+                    }
+                }
+            }
+        };
+
+        // Writes each argument as the next value, converting it the same way picojson::value constructor
+        // would, but without constructing a picojson::value for common scalar types.
+        inline void write_args(writer&) {
+        }
+
+        template <class Arg>
+        inline void write_arg(writer& writer, const Arg& arg) {
+            writer.write_value(picojson::value(arg));
+        }
+
+        inline void write_arg(writer& writer, const picojson::value& arg) {
+            writer.write_value(arg);
+        }
+
+        inline void write_arg(writer& writer, double arg) {
+            // picojson::value(double) rejects these the same way.
+            if (!std::isfinite(arg)) {
+                throw std::overflow_error("");
+            }
+            writer.write_number(arg);
+        }
+
+        inline void write_arg(writer& writer, bool arg) {
+            writer.write_bool(arg);
+        }
+
+        inline void write_arg(writer& writer, const std::string& arg) {
+            writer.write_string(arg);
+        }
+
+        inline void write_arg(writer& writer, const char* arg) {
+            writer.write_string(arg, strlen(arg));
+        }
+
+        template <class Arg, class... Args>
+        inline void write_args(writer& writer, const Arg& arg, const Args&... args) {
+            write_arg(writer, arg);
+            write_args(writer, args...);
+        }
+
+        // Index of the top-level elements of a JSON array, built in a single pass over the text, which skips
+        // over strings and nested containers 16 bytes at a time. Elements are only parsed when accessed, so
+        // a handler that reads the first couple of arguments does not pay for the rest of them.
+        //
+        // Only the structure is validated upfront: the text must be an array, strings in it must be properly
+        // terminated, and brackets must match. An element is fully validated when it's parsed; get() reports
+        // a malformed element as a fatal error, same as message::json() does for malformed JSON in general.
+        //
+        // The index refers to the text in place, and so the text must outlive it. If an arena is provided, the
+        // index itself is allocated from it, and so the arena must outlive it, too.
+        class array_index {
+        public:
+            explicit array_index(util::arena* arena = nullptr) :
+                _elements(util::arena_allocator<element>(arena)) {
+            }
+
+            // Indexes text[0..size). Anything after the closing bracket of the array is ignored, same as
+            // picojson::parse does. Returns an empty string on success, and the error description otherwise.
+            std::string parse(const char* text, size_t size);
+
+            size_t size() const {
+                return _elements.size();
+            }
+
+            bool empty() const {
+                return _elements.empty();
+            }
+
+            // Same as picojson::value::is<T>(), but only looks at the first character of the element, and
+            // so does not guarantee that get<T>() will succeed.
+            template <class T>
+            bool is(size_t i) const;
+
+            // Same as picojson::value::get<T>() for T = bool, double, std::string; or parses the element
+            // in its entirety for T = picojson::value.
+            template <class T>
+            T get(size_t i) const;
+
+            // Returns the value of a string element. If it has no escape sequences, the view refers directly to
+            // the text; otherwise, the string is unescaped into storage allocated from arena.
+            boost::string_view get_string(size_t i, util::arena& arena) const;
+
+            // JSON text of the element.
+            std::string text(size_t i) const {
+                return std::string(_elements[i].first, _elements[i].second);
+            }
+
+            // Parses all elements.
+            picojson::array to_array() const;
+
+        private:
+            typedef std::pair<const char*, const char*> element;
+            std::vector<element, util::arena_allocator<element>> _elements;
+
+            char first_char(size_t i) const {
+                return *_elements[i].first;
+            }
+        };
+
+        template <>
+        inline bool array_index::is<picojson::null>(size_t i) const {
+            return first_char(i) == 'n';
+        }
+
+        template <>
+        inline bool array_index::is<bool>(size_t i) const {
+            char c = first_char(i);
+            return c == 't' || c == 'f';
+        }
+
+        template <>
+        inline bool array_index::is<double>(size_t i) const {
+            char c = first_char(i);
+            return c == '-' || (c >= '0' && c <= '9');
+        }
+
+        template <>
+        inline bool array_index::is<std::string>(size_t i) const {
+            return first_char(i) == '"';
+        }
+
+        template <>
+        inline bool array_index::is<picojson::array>(size_t i) const {
+            return first_char(i) == '[';
+        }
+
+        template <>
+        inline bool array_index::is<picojson::object>(size_t i) const {
+            return first_char(i) == '{';
+        }
+
+        template <>
+        picojson::value array_index::get<picojson::value>(size_t i) const;
+
+        template <>
+        bool array_index::get<bool>(size_t i) const;
+
+        template <>
+        double array_index::get<double>(size_t i) const;
+
+        template <>
+        std::string array_index::get<std::string>(size_t i) const;
+
         // Produces JSON from an R object according to the following mappings:
         //
         // NULL, NA, empty vector -> null
@@ -33,21 +272,24 @@ namespace rhost {
         // FALSE -> false
         // Vector of a single non-NA integer or double -> numeric literal
         // Vector of a single non-NA string -> string literal
+        // Logical, integer, double or character vector of 2 or more elements -> array, with NA elements as null
         // List with all elements unnamed -> array (recursively)
         // List with all elements named, or environment -> object (recursively)
         //
         // If any element of a list or environment is NA, that element is skipped.
         // Any input not covered by the rules above is considered invalid.
         //
+        // Object members are written sorted by name, same as picojson::object does.
+        //
         // Returns true if serialized value was NA, and false otherwise (even if it contains NA somewhere inside).
-        // Errors are reported via Rf_error.
-        bool to_json(SEXP sexp, picojson::value& result);
-
-        // Same as above, but value is returned directly instead of being constructed in the provided location,
-        // and errors are reported as C++ exceptions.
-        inline picojson::value to_json(SEXP sexp) {
-            picojson::value result;
-            rhost::util::errors_to_exceptions([&] { to_json(sexp, result); });
+        // Errors are reported via Rf_error; what has been written to the writer by then is unspecified.
+        bool to_json(SEXP sexp, writer& writer);
+
+        // Same as above, but JSON text is returned directly, and errors are reported as C++ exceptions.
+        inline std::string to_json(SEXP sexp) {
+            std::string result;
+            writer writer(result);
+            rhost::util::errors_to_exceptions([&] { to_json(sexp, writer); });
             return result;
         }
     }
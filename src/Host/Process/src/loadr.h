@@ -35,6 +35,7 @@ macro(CDR) \
 macro(INTEGER) \
 macro(LOGICAL) \
 macro(PRCODE) \
+macro(PRINTNAME) \
 macro(PRVALUE) \
 macro(R_BaseEnv) \
 macro(R_CHAR) \
@@ -98,8 +99,10 @@ macro(Rf_ScalarInteger) \
 macro(Rf_ScalarLogical) \
 macro(Rf_ScalarReal) \
 macro(Rf_ScalarString) \
+macro(Rf_setAttrib) \
 macro(Rf_translateCharUTF8) \
 macro(Rf_unprotect) \
+macro(Rf_xlength) \
 macro(SET_RDEBUG) \
 macro(SET_STRING_ELT) \
 macro(SET_TYPEOF) \
@@ -155,6 +158,7 @@ RHOST_RAPI_SET_WINDOWS(macro)
 #else // POSIX
 
 #define RHOST_RAPI_SET_POSIX(macro) \
+macro(addInputHandler) \
 macro(ptr_R_Busy) \
 macro(ptr_R_ProcessEvents) \
 macro(ptr_R_ReadConsole) \
@@ -168,6 +172,7 @@ macro(R_InputHandlers) \
 macro(R_Interactive) \
 macro(R_Outputfile) \
 macro(R_runHandlers) \
+macro(R_wait_usec) \
 macro(Rf_initialize_R)
 
 #define RHOST_RAPI_SET(macro) \
@@ -206,6 +211,7 @@ namespace rhost {
 #define INTEGER rhost::rapi::RHOST_RAPI_PTR(INTEGER)
 #define LOGICAL rhost::rapi::RHOST_RAPI_PTR(LOGICAL)
 #define PRCODE rhost::rapi::RHOST_RAPI_PTR(PRCODE)
+#define PRINTNAME rhost::rapi::RHOST_RAPI_PTR(PRINTNAME)
 #define PRVALUE rhost::rapi::RHOST_RAPI_PTR(PRVALUE)
 #define R_BaseEnv (*rhost::rapi::RHOST_RAPI_PTR(R_BaseEnv))
 #define R_CHAR rhost::rapi::RHOST_RAPI_PTR(R_CHAR)
@@ -277,9 +283,11 @@ namespace rhost {
 #define Rf_ScalarLogical rhost::rapi::RHOST_RAPI_PTR(Rf_ScalarLogical)
 #define Rf_ScalarReal rhost::rapi::RHOST_RAPI_PTR(Rf_ScalarReal)
 #define Rf_ScalarString rhost::rapi::RHOST_RAPI_PTR(Rf_ScalarString)
+#define Rf_setAttrib rhost::rapi::RHOST_RAPI_PTR(Rf_setAttrib)
 #define Rf_selectDevice rhost::rapi::RHOST_RAPI_PTR(Rf_selectDevice)
 #define Rf_translateCharUTF8 rhost::rapi::RHOST_RAPI_PTR(Rf_translateCharUTF8)
 #define Rf_unprotect rhost::rapi::RHOST_RAPI_PTR(Rf_unprotect)
+#define Rf_xlength rhost::rapi::RHOST_RAPI_PTR(Rf_xlength)
 #define run_Rmainloop rhost::rapi::RHOST_RAPI_PTR(run_Rmainloop)
 #define SET_RDEBUG rhost::rapi::RHOST_RAPI_PTR(SET_RDEBUG)
 #define SET_STRING_ELT rhost::rapi::RHOST_RAPI_PTR(SET_STRING_ELT)
@@ -308,6 +316,7 @@ namespace rhost {
 
 #else // POSIX
 
+#define addInputHandler rhost::rapi::RHOST_RAPI_PTR(addInputHandler)
 #define ptr_R_Busy (*rhost::rapi::RHOST_RAPI_PTR(ptr_R_Busy))
 #define ptr_R_ProcessEvents (*rhost::rapi::RHOST_RAPI_PTR(ptr_R_ProcessEvents))
 #define ptr_R_ReadConsole (*rhost::rapi::RHOST_RAPI_PTR(ptr_R_ReadConsole))
@@ -321,6 +330,7 @@ namespace rhost {
 #define R_Interactive_ (*rhost::rapi::RHOST_RAPI_PTR(R_Interactive))
 #define R_Outputfile (*rhost::rapi::RHOST_RAPI_PTR(R_Outputfile))
 #define R_runHandlers rhost::rapi::RHOST_RAPI_PTR(R_runHandlers)
+#define R_wait_usec (*rhost::rapi::RHOST_RAPI_PTR(R_wait_usec))
 #define Rf_initialize_R rhost::rapi::RHOST_RAPI_PTR(Rf_initialize_R)
 
 #endif 
@@ -30,6 +30,7 @@
 #include "grdeviceside.h"
 #include "exports.h"
 #include "transport.h"
+#include "blobs.h"
 
 using namespace rhost::eval;
 using namespace rhost::log;
@@ -50,6 +51,10 @@ namespace rhost {
         std::string name;
         log::log_verbosity log_level;
         std::chrono::seconds idle_timeout;
+        std::chrono::milliseconds console_flush_interval;
+        size_t console_flush_size;
+        size_t shared_blob_threshold;
+        size_t blob_mem_limit;
         std::vector<std::string> unrecognized;
         bool suppress_ui;
         bool is_interactive;
@@ -80,10 +85,21 @@ namespace rhost {
             is_interactive("rhost-interactive", new po::untyped_value(true),
                 "This R is configured to start in interactive mode."),
             r_dir("rhost-r-dir", po::value<std::string>(), 
-                "Directory to load R.");
+                "Directory to load R."),
+            console_flush_interval("rhost-console-flush-interval", po::value<std::chrono::milliseconds::rep>(),
+                "Maximum time in milliseconds that console output is held back to be merged with subsequent output. "
+                "0 disables merging. Default is 16."),
+            console_flush_size("rhost-console-flush-size", po::value<size_t>(),
+                "Maximum size in bytes of merged console output before it is sent. Default is 65536."),
+            shared_blob_threshold("rhost-shared-blob-threshold", po::value<size_t>(),
+                "Exchange blobs of at least this many bytes with the client via shared memory instead of the pipe. "
+                "The client must support it. Disabled by default."),
+            blob_mem_limit("rhost-blob-mem-limit", po::value<size_t>(),
+                "Maximum memory in bytes used by blobs. Least recently used blobs over the limit are moved to temporary files. "
+                "Unlimited by default.");
 
         po::options_description desc;
-        for (auto&& opt : { help, name, log_level, log_dir, rdata, idle_timeout, suppress_ui, is_interactive, r_dir }) {
+        for (auto&& opt : { help, name, log_level, log_dir, rdata, idle_timeout, suppress_ui, is_interactive, r_dir, console_flush_interval, console_flush_size, shared_blob_threshold, blob_mem_limit }) {
             boost::shared_ptr<po::option_description> popt(new po::option_description(opt));
             desc.add(popt);
         }
@@ -135,6 +151,31 @@ namespace rhost {
             args.idle_timeout = std::chrono::seconds(n);
         }
 
+        auto console_flush_interval_arg = vm.find(console_flush_interval.long_name());
+        if (console_flush_interval_arg != vm.end()) {
+            auto n = console_flush_interval_arg->second.as<std::chrono::milliseconds::rep>();
+            args.console_flush_interval = std::chrono::milliseconds(n);
+        } else {
+            args.console_flush_interval = std::chrono::milliseconds(16);
+        }
+
+        auto console_flush_size_arg = vm.find(console_flush_size.long_name());
+        if (console_flush_size_arg != vm.end()) {
+            args.console_flush_size = console_flush_size_arg->second.as<size_t>();
+        } else {
+            args.console_flush_size = 0x10000;
+        }
+
+        auto shared_blob_threshold_arg = vm.find(shared_blob_threshold.long_name());
+        if (shared_blob_threshold_arg != vm.end()) {
+            args.shared_blob_threshold = shared_blob_threshold_arg->second.as<size_t>();
+        }
+
+        auto blob_mem_limit_arg = vm.find(blob_mem_limit.long_name());
+        if (blob_mem_limit_arg != vm.end()) {
+            args.blob_mem_limit = blob_mem_limit_arg->second.as<size_t>();
+        }
+
         args.suppress_ui = vm.count(suppress_ui.long_name()) != 0;
         args.is_interactive = vm.count(is_interactive.long_name()) != 0;
 
@@ -305,7 +346,8 @@ namespace rhost {
     int run(int argc, char** argv) {
         auto args = rhost::parse_command_line(argc, argv);
         init_log(args.name, args.log_dir, args.log_level, args.suppress_ui);
-        transport::initialize();
+        transport::initialize(args.console_flush_interval, args.console_flush_size, args.shared_blob_threshold);
+        blobs::set_memory_limit(args.blob_mem_limit);
 
         if (args.r_dir.empty()) {
             logf(log_verbosity::minimal, "--rhost-r-dir is a required argument");
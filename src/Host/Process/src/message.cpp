@@ -39,30 +39,67 @@ namespace rhost {
                 log::logf(log::log_verbosity::traffic, "%s\n\n", str.str().c_str());
                 log::flush_log();
             }
+
+            // Extra room reserved in the payload, so that a typical short argument list fits without growing it.
+            const size_t payload_slack = 64;
+
+            // Header and name of the payload, with room reserved for the rest of it.
+            std::string make_header(message_id id, message_id request_id, boost::string_view name, size_t size_hint) {
+                std::string payload;
+                payload.reserve(sizeof(message_repr) + name.size() + 1 + size_hint + 1 + payload_slack);
+
+                boost::endian::little_uint64_buf_t id_buf(id), request_id_buf(request_id);
+                payload.append(reinterpret_cast<const char*>(id_buf.data()), sizeof id_buf);
+                payload.append(reinterpret_cast<const char*>(request_id_buf.data()), sizeof request_id_buf);
+
+                payload.append(name.data(), name.size());
+                payload.push_back('\0');
+                return payload;
+            }
         }
 
         message::message(message_id request_id, const std::string& name, const std::string& json, const std::vector<char>& blob) :
+            message(message_builder(request_id, name, json.size() + blob.size()).raw_json(json).finish(blob)) {
+        }
+
+        message_builder::message_builder(message_id request_id, boost::string_view name, size_t size_hint) :
             _id(last_message_id += 2),
             _request_id(request_id),
-            _payload(sizeof _id + sizeof _request_id + name.size() + 1 + json.size() + 1 + blob.size(), '\0') {
+            _payload(make_header(_id, request_id, name, size_hint)),
+            _json(_payload.size()),
+            _writer(_payload) {
+        }
 
-            auto& repr = *reinterpret_cast<message_repr*>(&_payload[0]);
-            repr.id = _id;
-            repr.request_id = _request_id;
+        message_builder::message_builder(const message& request, size_t size_hint) :
+            message_builder(request.id(), request.name(), size_hint) {
+            assert(request.name()[0] == '?');
+            _payload[sizeof(message_repr)] = ':';
+        }
 
-            const char* start = &_payload.front();
-            char* p = repr.data;
+        message message_builder::finish(const char* blob_data, size_t blob_size) {
+            _payload.push_back('\0');
+            ptrdiff_t blob = _payload.size();
+            if (blob_size != 0) {
+                _payload.append(blob_data, blob_size);
+            }
+            return make_message(blob);
+        }
 
-            _name = p - start;
-            strcpy(p, name.c_str());
-            p += name.size() + 1;
+        message message_builder::finish(blobs::blob_view blob) {
+            message msg = finish();
+            msg._blob_view = std::move(blob);
+            return msg;
+        }
 
-            _json = p - start;
-            strcpy(p, json.c_str());
-            p += json.size() + 1;
+        message message_builder::finish(const blob_writer& write_blob) {
+            _payload.push_back('\0');
+            ptrdiff_t blob = _payload.size();
+            write_blob(_payload);
+            return make_message(blob);
+        }
 
-            _blob = p - start;
-            memcpy(p, blob.data(), blob.size());
+        message message_builder::make_message(ptrdiff_t blob) {
+            return message(_id, _request_id, std::move(_payload), sizeof(message_repr), _json, blob);
         }
 
         message message::parse(std::string&& payload) {
@@ -121,5 +158,37 @@ namespace rhost {
 
             return result.get<picojson::array>();
         }
+
+        const json::array_index& message::args() const {
+            if (!_args.index) {
+                _args.index.emplace(&_args.arena);
+                std::string err = _args.index->parse(json_text(), _blob - _json - 1);
+                if (!err.empty()) {
+                    log_payload(_payload);
+                    log::fatal_error("Malformed JSON payload - %s: %s", err.c_str(), json_text());
+                }
+
+                _args.strings.resize(_args.index->size());
+            }
+            return *_args.index;
+        }
+
+        void message::check_arg(size_t i) const {
+            if (i >= arg_count()) {
+                log_payload(_payload);
+                log::fatal_error("Message '%s' has %zu arguments, but argument [%zu] was requested", name(), arg_count(), i);
+            }
+        }
+
+        template <>
+        boost::string_view message::arg<boost::string_view>(size_t i) const {
+            check_arg(i);
+
+            auto& s = _args.strings[i];
+            if (!s) {
+                s = args().get_string(i, _args.arena);
+            }
+            return *s;
+        }
     }
 }
@@ -23,6 +23,7 @@
 #pragma once
 #include "stdafx.h"
 #include "blobs.h"
+#include "json.h"
 
 namespace rhost {
     namespace protocol {
@@ -47,12 +48,20 @@ namespace rhost {
 
             message(message_id request_id, const std::string& name, const std::string& json, const std::vector<char>& blob);
 
-            static message parse(std::string&& payload);
+            // The blob is not copied into the payload; instead, the message holds on to the view, and the
+            // transport writes the data directly from the chunks of the blob store.
+            message(message_id request_id, const std::string& name, const std::string& json, blobs::blob_view blob) :
+                message(request_id, name, json, blobs::blob()) {
+                _blob_view = std::move(blob);
+            }
 
-            static message parse(const std::string& payload) {
-                return parse(std::string(payload));
+            message(message_id request_id, const std::string& name, const picojson::array& json, blobs::blob_view blob) :
+                message(request_id, name, picojson::value(json).serialize(), std::move(blob)) {
             }
 
+            // Takes ownership of payload; the message refers to name, JSON and blob in place.
+            static message parse(std::string&& payload);
+
             const std::string& payload() const {
                 return _payload;
             }
@@ -81,15 +90,46 @@ namespace rhost {
                 return &_payload[_name];
             }
 
+            // Blob data is not contiguous for messages constructed from a blob_view, so this cannot be used
+            // for them; use for_each_blob_segment instead.
             const char* blob_data() const {
-                return &_payload[_blob];
+                assert(!_blob_view);
+                return _external_blob ? _external_blob.get() : &_payload[_blob];
             }
 
             size_t blob_size() const {
-                return _payload.size() - _blob;
+                if (_blob_view) {
+                    return _blob_view->size();
+                }
+                return _external_blob ? _external_blob_size : _payload.size() - _blob;
+            }
+
+            // Invokes f(const char* data, size_t size) for every contiguous segment of the blob, in order.
+            template <class F>
+            void for_each_blob_segment(F f) const {
+                if (_blob_view) {
+                    _blob_view->for_each_segment(f);
+                } else if (blob_size() != 0) {
+                    f(blob_data(), blob_size());
+                }
+            }
+
+            // Offset of the blob within payload; everything before it is the header, name and JSON.
+            size_t blob_offset() const {
+                return _blob;
+            }
+
+            // Replaces the blob with data that is stored outside of the payload (e.g. in a shared memory
+            // region). The blob part of the payload itself is left as is, and is no longer considered data.
+            void set_external_blob(std::shared_ptr<const char> data, size_t size) {
+                _external_blob = std::move(data);
+                _external_blob_size = size;
             }
 
             blobs::blob blob() const {
+                if (_blob_view) {
+                    return _blob_view->to_blob();
+                }
                 return blobs::blob(blob_data(), blob_data() + blob_size());
             }
 
@@ -99,7 +139,32 @@ namespace rhost {
 
             picojson::array json() const;
 
+            // Index of the top-level elements of the JSON array. It is built on first use and then reused, so
+            // a message can be inspected repeatedly without parsing it again. Cheaper than json() for handlers
+            // that only need some of the elements, or only need them as strings or numbers.
+            const json::array_index& args() const;
+
+            size_t arg_count() const {
+                return args().size();
+            }
+
+            // Whether the argument exists, and looks like a value of type T; see json::array_index::is.
+            template <class T>
+            bool arg_is(size_t i) const {
+                return i < arg_count() && args().template is<T>(i);
+            }
+
+            // Parses the argument as T; see json::array_index::get. For T = boost::string_view, the string is
+            // not copied unless it needs unescaping, in which case it is unescaped once into an arena owned by
+            // the message; the view is valid until the message is destroyed, copied to, or moved from.
+            template <class T>
+            T arg(size_t i) const {
+                check_arg(i);
+                return args().template get<T>(i);
+            }
+
         private:
+            friend class message_builder;
 
             message_id _id;
             message_id _request_id;
@@ -111,10 +176,117 @@ namespace rhost {
             ptrdiff_t _json;
             ptrdiff_t _blob;
 
+            std::shared_ptr<const char> _external_blob;
+            size_t _external_blob_size = 0;
+
+            boost::optional<blobs::blob_view> _blob_view;
+
+            // Parsed state that refers into _payload. It is not carried over when a message is copied or moved,
+            // but rather rebuilt on demand, since the payload buffer itself may be different afterwards.
+            //
+            // Everything is allocated from the arena, which is released in bulk along with the message. Its
+            // initial buffer is large enough for the index of a typical request, so handling one does not need
+            // any heap allocations beyond the payload itself, unless some strings need unescaping.
+            struct args_cache {
+                typedef boost::optional<boost::string_view> cached_string;
+                typedef std::vector<cached_string, util::arena_allocator<cached_string>> cached_strings;
+
+                char initial[256];
+                util::arena arena{ initial, sizeof initial };
+                boost::optional<json::array_index> index;
+                cached_strings strings = cached_strings(util::arena_allocator<cached_string>(&arena));
+
+                args_cache() {
+                }
+
+                args_cache(const args_cache&) {
+                }
+
+                args_cache& operator=(const args_cache&) {
+                    index.reset();
+                    cached_strings(util::arena_allocator<cached_string>(&arena)).swap(strings);
+                    arena.reset();
+                    return *this;
+                }
+            };
+
+            // Not thread-safe; a message is only ever handled by one thread at a time.
+            mutable args_cache _args;
+
+            void check_arg(size_t i) const;
+
             message(message_id id, message_id request_id, std::string&& payload, ptrdiff_t name, ptrdiff_t json, ptrdiff_t blob) :
                 _id(id), _request_id(request_id), _payload(std::move(payload)),
                 _name(name), _json(json), _blob(blob) {
             }
         };
+
+        template <>
+        boost::string_view message::arg<boost::string_view>(size_t i) const;
+
+        // Appends the blob to the end of payload. Allows serializers to write the blob directly into the
+        // payload, without producing it separately first.
+        typedef std::function<void(std::string& payload)> blob_writer;
+
+        // Builds the payload of an outgoing message in a single buffer: the header and the name are written
+        // on construction, then JSON is written through json() or args(), and then finish() appends the blob.
+        // There is no intermediate picojson::value or string for the JSON, and if size_hint is accurate,
+        // the payload is allocated exactly once.
+        class message_builder {
+        public:
+            // size_hint is the expected size of JSON and blob combined.
+            message_builder(message_id request_id, boost::string_view name, size_t size_hint = 0);
+
+            // Builder for a response to the request, with the same name, except that '?' becomes ':'.
+            explicit message_builder(const message& request, size_t size_hint = 0);
+
+            // Writer for the JSON part of the payload, which must be a single array.
+            json::writer& json() {
+                return _writer;
+            }
+
+            // Writes the JSON part as an array of the given values; see json::write_args.
+            template <class... Args>
+            message_builder& args(const Args&... args) {
+                _writer.begin_array();
+                json::write_args(_writer, args...);
+                _writer.end_array();
+                return *this;
+            }
+
+            // Writes the JSON part from text that is already serialized.
+            message_builder& raw_json(boost::string_view json) {
+                _payload.append(json.data(), json.size());
+                return *this;
+            }
+
+            message finish(const char* blob_data, size_t blob_size);
+
+            message finish() {
+                return finish(nullptr, 0);
+            }
+
+            message finish(const blobs::blob& blob) {
+                return finish(blob.data(), blob.size());
+            }
+
+            // The blob is not copied into the payload; see message::message(..., blobs::blob_view).
+            message finish(blobs::blob_view blob);
+
+            message finish(const blob_writer& write_blob);
+
+        private:
+            message_id _id;
+            message_id _request_id;
+            std::string _payload;
+            ptrdiff_t _json;
+            json::writer _writer;
+
+            message make_message(ptrdiff_t blob);
+
+            // The writer refers to _payload.
+            message_builder(const message_builder&) = delete;
+            message_builder& operator=(const message_builder&) = delete;
+        };
     }
 }
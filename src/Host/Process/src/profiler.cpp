@@ -0,0 +1,239 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+
+#include "profiler.h"
+#include "r_api.h"
+
+namespace rhost {
+    namespace profiler {
+        std::atomic<bool> is_sample_due(false);
+
+        namespace {
+            const size_t max_depth = 64;
+            const size_t max_file_length = 64;
+            const size_t buffer_capacity = 4096;
+
+            struct sample {
+                // Names of the functions on the stack, innermost first. These are names of symbols, which R never
+                // frees, so they can be kept around without copying.
+                const char* frames[max_depth];
+                size_t depth;
+                // Whether the stack was deeper than max_depth, and outermost frames were omitted.
+                bool is_truncated;
+                // Source location of the innermost frame, if it has one (line is 0 otherwise). Long file names
+                // are truncated from the left.
+                int line;
+                char file[max_file_length];
+            };
+
+            // Guards the ring buffer and the counters. The R thread only holds it while recording a sample, and
+            // the receive thread while aggregating them, so there's no contention outside of take_profile.
+            std::mutex samples_mutex;
+            std::vector<sample> samples;
+            size_t next_sample, sample_count, dropped_count;
+
+            // Every start or stop bumps the generation, which tells the timer thread of the previous one to exit.
+            std::mutex timer_mutex;
+            std::condition_variable timer_cond;
+            uint64_t timer_generation;
+
+            void timer_thread(std::chrono::milliseconds interval, uint64_t generation) {
+                std::unique_lock<std::mutex> lock(timer_mutex);
+                while (!timer_cond.wait_for(lock, interval, [&] { return timer_generation != generation; })) {
+                    is_sample_due = true;
+                }
+            }
+
+            const char* get_function_name(SEXP call) {
+                if (TYPEOF(call) == LANGSXP) {
+                    SEXP fun = CAR(call);
+                    if (TYPEOF(fun) == SYMSXP) {
+                        return R_CHAR(PRINTNAME(fun));
+                    }
+                }
+                return "<anonymous>";
+            }
+
+            void get_source_location(sample& s) {
+                static SEXP srcfile_sym = Rf_install("srcfile");
+                static SEXP filename_sym = Rf_install("filename");
+
+                s.line = 0;
+                s.file[0] = '\0';
+
+                // R_Srcref is also set to a marker symbol while the bytecode interpreter is running, in which case
+                // the location is unknown.
+                SEXP srcref = R_Srcref;
+                if (!srcref || TYPEOF(srcref) != INTSXP || Rf_length(srcref) < 1) {
+                    return;
+                }
+                s.line = INTEGER(srcref)[0];
+
+                SEXP srcfile = Rf_getAttrib(srcref, srcfile_sym);
+                if (TYPEOF(srcfile) != ENVSXP) {
+                    return;
+                }
+
+                SEXP filename = Rf_findVar(filename_sym, srcfile);
+                if (TYPEOF(filename) != STRSXP || Rf_length(filename) < 1) {
+                    return;
+                }
+
+                const char* file = R_CHAR(STRING_ELT(filename, 0));
+                size_t len = strlen(file);
+                if (len >= max_file_length) {
+                    file += len - (max_file_length - 1);
+                    len = max_file_length - 1;
+                }
+                memcpy(s.file, file, len);
+                s.file[len] = '\0';
+            }
+
+            // Every stack is a single line of folded output, with frames separated by ';', so the text that goes
+            // into it can't contain either.
+            void append_escaped(std::string& stack, const char* text) {
+                for (const char* p = text; *p; ++p) {
+                    stack += (*p == ';' || *p == '\n' || *p == '\r') ? '_' : *p;
+                }
+            }
+
+            void append_frame(std::string& stack, const char* name) {
+                if (!stack.empty()) {
+                    stack += ';';
+                }
+                append_escaped(stack, name);
+            }
+        }
+
+        void start(std::chrono::milliseconds interval) {
+            {
+                std::lock_guard<std::mutex> lock(samples_mutex);
+                samples.resize(buffer_capacity);
+                next_sample = sample_count = dropped_count = 0;
+            }
+
+            uint64_t generation;
+            {
+                std::lock_guard<std::mutex> lock(timer_mutex);
+                generation = ++timer_generation;
+            }
+            timer_cond.notify_all();
+
+            std::thread([=] { timer_thread(interval, generation); }).detach();
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(timer_mutex);
+                ++timer_generation;
+            }
+            timer_cond.notify_all();
+
+            // The timer thread only sets the flag while holding the lock, and checks the generation first, so
+            // it can't be set again after this.
+            is_sample_due = false;
+        }
+
+        profile take_profile() {
+            profile result = {};
+
+            std::map<std::string, size_t> stacks;
+            std::string stack;
+            char location[max_file_length + 32];
+            {
+                std::lock_guard<std::mutex> lock(samples_mutex);
+
+                result.sample_count = sample_count;
+                result.dropped_count = dropped_count;
+
+                for (size_t i = 0; i < sample_count; ++i) {
+                    const sample& s = samples[(next_sample + samples.size() - sample_count + i) % samples.size()];
+
+                    stack.clear();
+                    if (s.is_truncated) {
+                        append_frame(stack, "...");
+                    }
+                    for (size_t j = s.depth; j != 0; --j) {
+                        append_frame(stack, s.frames[j - 1]);
+                    }
+                    if (s.line > 0) {
+                        if (s.file[0]) {
+                            snprintf(location, sizeof location, " (%s:%d)", s.file, s.line);
+                        } else {
+                            snprintf(location, sizeof location, " (line %d)", s.line);
+                        }
+                        append_escaped(stack, location);
+                    }
+
+                    ++stacks[stack];
+                }
+
+                next_sample = sample_count = dropped_count = 0;
+            }
+
+            for (const auto& kv : stacks) {
+                result.folded += kv.first;
+                result.folded += ' ';
+                result.folded += std::to_string(kv.second);
+                result.folded += '\n';
+            }
+
+            return result;
+        }
+
+        void record_sample() {
+            is_sample_due = false;
+
+            std::lock_guard<std::mutex> lock(samples_mutex);
+            if (samples.empty()) {
+                return;
+            }
+
+            sample& s = samples[next_sample];
+            s.depth = 0;
+            s.is_truncated = false;
+            for (RCNTXT* ctxt = reinterpret_cast<RCNTXT*>(R_GlobalContext); ctxt != nullptr; ctxt = ctxt->nextcontext) {
+                if (!(ctxt->callflag & CTXT_FUNCTION)) {
+                    continue;
+                }
+                if (s.depth == max_depth) {
+                    s.is_truncated = true;
+                    break;
+                }
+                s.frames[s.depth++] = get_function_name(ctxt->call);
+            }
+
+            if (s.depth == 0) {
+                return;
+            }
+
+            get_source_location(s);
+
+            next_sample = (next_sample + 1) % samples.size();
+            if (sample_count < samples.size()) {
+                ++sample_count;
+            } else {
+                ++dropped_count;
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+
+#pragma once
+#include "stdafx.h"
+
+namespace rhost {
+    namespace profiler {
+        // Sampling profiler for R code. While it runs, a timer thread marks a sample as due once per interval,
+        // and the R thread records its current call stack the next time it checks in with the host (see
+        // sample_if_due). Unlike Rprof, nothing is written to disk, and the session doesn't need to be
+        // restarted to get the results.
+        //
+        // Samples are recorded into a ring buffer that is preallocated when the profiler is started, so taking
+        // a sample doesn't allocate; if the buffer fills up before the samples are taken, the oldest ones are
+        // overwritten. Samples taken while no R function is running (e.g. when R is idle) are not recorded.
+
+        struct profile {
+            size_t sample_count;
+            // Number of samples that were overwritten before they could be taken.
+            size_t dropped_count;
+            // One line per distinct stack, in the "folded" format used by flame graph tools:
+            // "outermost;...;innermost count\n". The innermost frame is annotated with its source location,
+            // if known.
+            std::string folded;
+        };
+
+        extern std::atomic<bool> is_sample_due;
+
+        // Starts profiling with the given sampling interval, discarding any samples that were not taken yet.
+        // If the profiler is already running, it is restarted.
+        void start(std::chrono::milliseconds interval);
+
+        // Stops profiling. Samples that were recorded so far can still be taken afterwards.
+        void stop();
+
+        // Aggregates all samples recorded since the last call into a profile, and discards them. The profiler
+        // keeps running if it was running.
+        profile take_profile();
+
+        // Must be called on the R thread.
+        void record_sample();
+
+        // Records a sample if one is due. Must be called on the R thread. This is called from the host callbacks
+        // that R invokes periodically during evaluation, and is cheap when no sample is due.
+        inline void sample_if_due() {
+            if (is_sample_due.load(std::memory_order_relaxed)) {
+                record_sample();
+            }
+        }
+    }
+}
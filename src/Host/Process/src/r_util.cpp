@@ -25,6 +25,7 @@
 #include "util.h"
 #include "host.h"
 #include "blobs.h"
+#include "eval.h"
 #include "json.h"
 #include "exports.h"
 #include "rstrtmgr.h"
@@ -262,15 +263,12 @@ namespace rhost {
             });
         }
 
-        picojson::array parse_args_sexp(SEXP args_sexp) {
-            size_t len = Rf_length(args_sexp);
-
-            picojson::value json = to_json(args_sexp);
-            if (!json.is<picojson::array>()) {
-                fatal_error("send_* requires argument that serializes to JSON array; got %s", json.serialize().c_str());
+        std::string parse_args_sexp(SEXP args_sexp) {
+            std::string json = to_json(args_sexp);
+            if (json.empty() || json[0] != '[') {
+                fatal_error("send_* requires argument that serializes to JSON array; got %s", json.c_str());
             }
-
-            return json.get<picojson::array>();
+            return json;
         }
 
         extern "C" SEXP send_notification(SEXP name_sexp, SEXP args_sexp) {
@@ -279,7 +277,7 @@ namespace rhost {
                 const char* name = R_CHAR(name_char.get());
 
                 auto args = parse_args_sexp(args_sexp);
-                host::send_notification(name, args);
+                host::send_json_notification(name, args);
 
                 return R_NilValue;
             });
@@ -290,10 +288,9 @@ namespace rhost {
                 protected_sexp name_char(Rf_asChar(name_sexp));
                 const char* name = R_CHAR(name_char.get());
 
-                auto args = parse_args_sexp(args_sexp);
-                auto response = host::send_request_and_get_response(name, args);
+                auto response = host::send_json_request_and_get_response(name, parse_args_sexp(args_sexp));
 
-                args = response.json();
+                auto args = response.json();
                 protected_sexp response_args(Rf_allocVector(VECSXP, args.size()));
 
                 for (size_t i = 0; i < args.size(); ++i) {
@@ -449,7 +446,7 @@ namespace rhost {
         }
 
         extern "C" SEXP toJSON(SEXP obj) {
-            SEXP json = Rf_mkCharCE(exceptions_to_errors([&] { return to_json(obj).serialize(); }).c_str(), CE_UTF8);
+            SEXP json = Rf_mkCharCE(exceptions_to_errors([&] { return to_json(obj); }).c_str(), CE_UTF8);
             Rf_protect(json);
             SEXP result = Rf_allocVector(STRSXP, 1);
             SET_STRING_ELT(result, 0, json);
@@ -466,19 +463,17 @@ namespace rhost {
             }
 
             Rbyte* data = RAW(obj);
-            blobs::blob_id id = rhost::host::create_blob(blobs::blob(data, data + length));
+            blobs::blob_id id = blobs::create_blob(reinterpret_cast<const char*>(data), length);
             return Rf_ScalarReal(static_cast<double>(id));
         }
 
         extern "C" SEXP get_blob(SEXP id) {
             auto blob_id = static_cast<blobs::blob_id>(Rf_asReal(id));
-            auto data = rhost::host::get_blob(blob_id);
+            auto data = blobs::get_blob(blob_id);
 
             SEXP rawVector = nullptr;
             Rf_protect(rawVector = Rf_allocVector(RAWSXP, data.size()));
-            Rbyte* dest = RAW(rawVector);
-
-            memcpy_s(dest, data.size(), data.data(), data.size());
+            data.copy_to(reinterpret_cast<char*>(RAW(rawVector)));
 
             Rf_unprotect(1);
             return rawVector;
@@ -486,10 +481,49 @@ namespace rhost {
 
         extern "C" SEXP destroy_blob(SEXP id) {
             auto blob_id = static_cast<blobs::blob_id>(Rf_asReal(id));
-            rhost::host::destroy_blob(blob_id);
+            blobs::destroy_blob(blob_id);
             return R_NilValue;
         }
 
+        namespace {
+            // Builds a named numeric vector, e.g. c(count = 1, hits = 2), from name/value pairs.
+            SEXP named_real_vector(std::initializer_list<std::pair<const char*, double>> values) {
+                const R_xlen_t n = static_cast<R_xlen_t>(values.size());
+                SEXP result = Rf_protect(Rf_allocVector(REALSXP, n));
+                SEXP names = Rf_protect(Rf_allocVector(STRSXP, n));
+
+                R_xlen_t i = 0;
+                for (const auto& value : values) {
+                    REAL(result)[i] = value.second;
+                    SET_STRING_ELT(names, i, Rf_mkChar(value.first));
+                    ++i;
+                }
+                Rf_setAttrib(result, R_NamesSymbol, names);
+
+                Rf_unprotect(2);
+                return result;
+            }
+        }
+
+        extern "C" SEXP get_blob_stats() {
+            auto stats = blobs::get_stats();
+            return named_real_vector({
+                { "count", static_cast<double>(stats.count) },
+                { "resident_bytes", static_cast<double>(stats.resident_bytes) },
+                { "spilled_bytes", static_cast<double>(stats.spilled_bytes) },
+                { "spill_count", static_cast<double>(stats.spill_count) },
+            });
+        }
+
+        extern "C" SEXP get_parse_cache_stats() {
+            auto stats = eval::get_parse_cache_stats();
+            return named_real_vector({
+                { "count", static_cast<double>(stats.count) },
+                { "hits", static_cast<double>(stats.hits) },
+                { "misses", static_cast<double>(stats.misses) },
+            });
+        }
+
         extern "C" SEXP get_file_lock_state(SEXP paths) {
             R_len_t len = Rf_length(paths);
             std::vector<std::wstring> files;
@@ -529,6 +563,8 @@ namespace rhost {
             { "Microsoft.R.Host::Call.create_blob", (DL_FUNC)create_blob, 1 },
             { "Microsoft.R.Host::Call.get_blob", (DL_FUNC)get_blob, 1 },
             { "Microsoft.R.Host::Call.destroy_blob", (DL_FUNC)destroy_blob, 1 },
+            { "Microsoft.R.Host::Call.get_blob_stats", (DL_FUNC)get_blob_stats, 0 },
+            { "Microsoft.R.Host::Call.get_parse_cache_stats", (DL_FUNC)get_parse_cache_stats, 0 },
             { "Microsoft.R.Host::Call.get_file_lock_state", (DL_FUNC)get_file_lock_state, 1 },
             { "Microsoft.R.Host::Call.set_disconnect_callback", (DL_FUNC)set_disconnect_callback, 1 },
             { "Microsoft.R.Host::Call.get_disconnect_callback", (DL_FUNC)get_disconnect_callback, 0 },
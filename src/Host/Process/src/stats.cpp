@@ -0,0 +1,324 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+
+#include "stats.h"
+#include "blobs.h"
+
+namespace rhost {
+    namespace stats {
+        latency_histogram eval_round_trip;
+        latency_histogram eval_queue_wait;
+        latency_histogram read_console_round_trip;
+        latency_histogram plot_render;
+
+        std::atomic<int64_t> eval_queue_depth{ 0 };
+
+        namespace {
+            const size_t max_message_names = 256;
+            const size_t max_message_name_length = 31;
+            const size_t max_devices = 64;
+            const size_t max_device_id_length = 39;
+
+            // Open addressing on the hash of the name. An entry is claimed by setting its key, and never released,
+            // so the name is written once, before has_name is set, and can be read without locking after that.
+            struct message_counters {
+                std::atomic<uint64_t> key;
+                std::atomic<bool> has_name;
+                char name[max_message_name_length + 1];
+                std::atomic<uint64_t> received, received_bytes, sent, sent_bytes;
+            };
+
+            message_counters messages[max_message_names] = {};
+
+            // Counters for all names that didn't fit into the table.
+            message_counters other_messages = {};
+
+            // Device slots are claimed and released as devices come and go, so the ID is guarded by a sequence
+            // number, seqlock-style: 0 mod 3 is free, 1 mod 3 is being claimed, and 2 mod 3 is in use. A reader
+            // only trusts the ID it has copied if the sequence number didn't change while it was copying.
+            struct device_counters {
+                std::atomic<uint64_t> seq;
+                char device_id[max_device_id_length + 1];
+                std::atomic<uint64_t> plot_count;
+            };
+
+            device_counters devices[max_devices] = {};
+
+            inline unsigned highest_set_bit(uint64_t value) {
+                uint32_t high = static_cast<uint32_t>(value >> 32);
+                uint32_t low = static_cast<uint32_t>(value);
+#ifdef _MSC_VER
+                unsigned long index;
+                if (high) {
+                    _BitScanReverse(&index, high);
+                    return index + 32;
+                }
+                _BitScanReverse(&index, low);
+                return index;
+#else
+                return high ? 63 - __builtin_clz(high) : 31 - __builtin_clz(low);
+#endif
+            }
+
+            // FNV-1a.
+            uint64_t hash_name(const char* name) {
+                uint64_t hash = 14695981039346656037ULL;
+                for (const char* p = name; *p; ++p) {
+                    hash ^= static_cast<unsigned char>(*p);
+                    hash *= 1099511628211ULL;
+                }
+                return hash ? hash : 1;
+            }
+
+            message_counters& get_message_counters(const char* name) {
+                uint64_t key = hash_name(name);
+                for (size_t i = 0; i < max_message_names; ++i) {
+                    message_counters& counters = messages[(key + i) % max_message_names];
+
+                    uint64_t existing = counters.key.load(std::memory_order_acquire);
+                    if (existing == 0) {
+                        if (counters.key.compare_exchange_strong(existing, key)) {
+                            strncpy(counters.name, name, max_message_name_length);
+                            counters.has_name.store(true, std::memory_order_release);
+                            return counters;
+                        }
+                        // Someone else claimed it first, and existing now has their key.
+                    }
+
+                    if (existing == key) {
+                        return counters;
+                    }
+                }
+                return other_messages;
+            }
+
+            void write_member(json::writer& writer, const char* key, double value) {
+                writer.write_key(key, strlen(key));
+                writer.write_number(value);
+            }
+
+            void write_counters(json::writer& writer, const char* name, const message_counters& counters) {
+                writer.write_key(name, strlen(name));
+                writer.begin_object();
+                write_member(writer, "received", double(counters.received.load(std::memory_order_relaxed)));
+                write_member(writer, "received_bytes", double(counters.received_bytes.load(std::memory_order_relaxed)));
+                write_member(writer, "sent", double(counters.sent.load(std::memory_order_relaxed)));
+                write_member(writer, "sent_bytes", double(counters.sent_bytes.load(std::memory_order_relaxed)));
+                writer.end_object();
+            }
+        }
+
+        size_t latency_histogram::bucket_index(uint64_t value) {
+            if (value < linear_limit) {
+                return static_cast<size_t>(value);
+            }
+
+            unsigned magnitude = highest_set_bit(value);
+            size_t sub_bucket = static_cast<size_t>(value >> (magnitude - sub_bucket_bits)) & (sub_bucket_count - 1);
+            return linear_limit + (magnitude - 4) * sub_bucket_count + sub_bucket;
+        }
+
+        uint64_t latency_histogram::bucket_lower_bound(size_t index) {
+            if (index < linear_limit) {
+                return index;
+            }
+
+            unsigned magnitude = static_cast<unsigned>(4 + (index - linear_limit) / sub_bucket_count);
+            uint64_t sub_bucket = (index - linear_limit) % sub_bucket_count;
+            return (sub_bucket_count + sub_bucket) << (magnitude - sub_bucket_bits);
+        }
+
+        uint64_t latency_histogram::bucket_upper_bound(size_t index) {
+            return index + 1 < bucket_count ? bucket_lower_bound(index + 1) - 1 : (uint64_t(1) << max_bits) - 1;
+        }
+
+        void latency_histogram::record(std::chrono::steady_clock::duration duration) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+            uint64_t value = us < 0 ? 0 : std::min(static_cast<uint64_t>(us), (uint64_t(1) << max_bits) - 1);
+
+            _counts[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+            _sum.fetch_add(value, std::memory_order_relaxed);
+
+            uint64_t max = _max.load(std::memory_order_relaxed);
+            while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+            }
+        }
+
+        void latency_histogram::write(json::writer& writer) const {
+            uint64_t counts[bucket_count];
+            uint64_t total = 0;
+            for (size_t i = 0; i < bucket_count; ++i) {
+                counts[i] = _counts[i].load(std::memory_order_relaxed);
+                total += counts[i];
+            }
+            uint64_t max = _max.load(std::memory_order_relaxed);
+
+            writer.begin_object();
+            write_member(writer, "count", double(total));
+            write_member(writer, "mean_ms", total ? _sum.load(std::memory_order_relaxed) / 1e3 / total : 0.0);
+            write_member(writer, "max_ms", max / 1e3);
+
+            // Percentiles are reported as the highest value that falls into the same bucket, same as HdrHistogram.
+            static const struct {
+                const char* name;
+                double fraction;
+            } percentiles[] = {
+                { "p50_ms", 0.5 },
+                { "p90_ms", 0.9 },
+                { "p99_ms", 0.99 },
+                { "p999_ms", 0.999 }
+            };
+            for (const auto& percentile : percentiles) {
+                uint64_t rank = static_cast<uint64_t>(std::ceil(percentile.fraction * total));
+                uint64_t value = 0, seen = 0;
+                for (size_t i = 0; i < bucket_count && total != 0; ++i) {
+                    seen += counts[i];
+                    if (seen >= rank && seen != 0) {
+                        value = std::min(bucket_upper_bound(i), max);
+                        break;
+                    }
+                }
+                write_member(writer, percentile.name, value / 1e3);
+            }
+
+            writer.write_key("buckets", 7);
+            writer.begin_array();
+            for (size_t i = 0; i < bucket_count; ++i) {
+                if (counts[i] != 0) {
+                    writer.begin_array();
+                    writer.write_number(double(bucket_lower_bound(i)));
+                    writer.write_number(double(counts[i]));
+                    writer.end_array();
+                }
+            }
+            writer.end_array();
+
+            writer.end_object();
+        }
+
+        void count_received(const char* name, size_t bytes) {
+            message_counters& counters = get_message_counters(name);
+            counters.received.fetch_add(1, std::memory_order_relaxed);
+            counters.received_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        void count_sent(const char* name, size_t bytes) {
+            message_counters& counters = get_message_counters(name);
+            counters.sent.fetch_add(1, std::memory_order_relaxed);
+            counters.sent_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        plot_history_counter::plot_history_counter(const std::string& device_id) :
+            _slot(-1) {
+            for (size_t i = 0; i < max_devices; ++i) {
+                device_counters& device = devices[i];
+                uint64_t seq = device.seq.load(std::memory_order_relaxed);
+                if (seq % 3 == 0 && device.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) {
+                    strncpy(device.device_id, device_id.c_str(), max_device_id_length);
+                    device.device_id[max_device_id_length] = '\0';
+                    device.plot_count.store(0, std::memory_order_relaxed);
+                    device.seq.store(seq + 2, std::memory_order_release);
+                    _slot = static_cast<int>(i);
+                    break;
+                }
+            }
+        }
+
+        plot_history_counter::~plot_history_counter() {
+            if (_slot >= 0) {
+                device_counters& device = devices[_slot];
+                device.seq.store(device.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+        }
+
+        void plot_history_counter::set(size_t plot_count) {
+            if (_slot >= 0) {
+                devices[_slot].plot_count.store(plot_count, std::memory_order_relaxed);
+            }
+        }
+
+        void write_stats(json::writer& writer) {
+            writer.begin_object();
+
+            writer.write_key("messages", 8);
+            writer.begin_object();
+            for (const auto& counters : messages) {
+                if (counters.has_name.load(std::memory_order_acquire)) {
+                    write_counters(writer, counters.name, counters);
+                }
+            }
+            if (other_messages.received.load(std::memory_order_relaxed) || other_messages.sent.load(std::memory_order_relaxed)) {
+                write_counters(writer, "<other>", other_messages);
+            }
+            writer.end_object();
+
+            writer.write_key("eval_queue", 10);
+            writer.begin_object();
+            write_member(writer, "depth", double(std::max<int64_t>(eval_queue_depth.load(std::memory_order_relaxed), 0)));
+            writer.write_key("wait", 4);
+            eval_queue_wait.write(writer);
+            writer.end_object();
+
+            auto blob_stats = blobs::get_stats();
+            writer.write_key("blobs", 5);
+            writer.begin_object();
+            write_member(writer, "count", double(blob_stats.count));
+            write_member(writer, "resident_bytes", double(blob_stats.resident_bytes));
+            write_member(writer, "spilled_bytes", double(blob_stats.spilled_bytes));
+            writer.end_object();
+
+            writer.write_key("plot_history", 12);
+            writer.begin_object();
+            for (const auto& device : devices) {
+                uint64_t seq = device.seq.load(std::memory_order_acquire);
+                if (seq % 3 != 2) {
+                    continue;
+                }
+
+                char device_id[max_device_id_length + 1];
+                memcpy(device_id, device.device_id, sizeof device_id);
+                uint64_t plot_count = device.plot_count.load(std::memory_order_relaxed);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (device.seq.load(std::memory_order_relaxed) != seq) {
+                    continue;
+                }
+
+                device_id[max_device_id_length] = '\0';
+                write_member(writer, device_id, double(plot_count));
+            }
+            writer.end_object();
+
+            writer.write_key("latency", 7);
+            writer.begin_object();
+            writer.write_key("?=", 2);
+            eval_round_trip.write(writer);
+            writer.write_key("?>", 2);
+            read_console_round_trip.write(writer);
+            writer.write_key("plot_render", 11);
+            plot_render.write(writer);
+            writer.end_object();
+
+            writer.end_object();
+        }
+    }
+}
@@ -0,0 +1,99 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+
+#pragma once
+#include "stdafx.h"
+#include "json.h"
+
+namespace rhost {
+    namespace stats {
+        // Histogram of durations in the style of HdrHistogram: values are bucketed by their power of two, and
+        // every power of two is split into 8 linear sub-buckets, so any recorded value is known to within 12.5%,
+        // with a fixed number of buckets covering everything from microseconds to days.
+        //
+        // Recording a value is a few relaxed atomic increments, so histograms can be updated from any thread,
+        // and read concurrently; a snapshot taken while values are being recorded may be slightly inconsistent.
+        class latency_histogram {
+        public:
+            void record(std::chrono::steady_clock::duration duration);
+
+            void record_since(std::chrono::steady_clock::time_point start) {
+                record(std::chrono::steady_clock::now() - start);
+            }
+
+            // Writes an object with the count, mean, max, and percentiles (in milliseconds), followed by
+            // [lower bound in microseconds, count] of every non-empty bucket.
+            void write(json::writer& writer) const;
+
+        private:
+            // Values below linear_limit get a bucket each; past that, every power of two gets sub_bucket_count.
+            static const uint64_t linear_limit = 16;
+            static const int sub_bucket_bits = 3;
+            static const size_t sub_bucket_count = 1 << sub_bucket_bits;
+            // Values are in microseconds, and anything above 2^max_bits is recorded as 2^max_bits - 1.
+            static const int max_bits = 41;
+            static const size_t bucket_count = linear_limit + (max_bits - 4) * sub_bucket_count;
+
+            static size_t bucket_index(uint64_t value);
+            static uint64_t bucket_lower_bound(size_t index);
+            static uint64_t bucket_upper_bound(size_t index);
+
+            std::atomic<uint64_t> _counts[bucket_count] = {};
+            std::atomic<uint64_t> _sum{ 0 };
+            std::atomic<uint64_t> _max{ 0 };
+        };
+
+        // Round trips of "?=" requests, from when the request is received to when the response is sent.
+        extern latency_histogram eval_round_trip;
+        // Time "?=" requests spend in the eval queue before R picks them up.
+        extern latency_histogram eval_queue_wait;
+        // Round trips of "?>" requests, from when the request is sent to when the response is processed.
+        extern latency_histogram read_console_round_trip;
+        // Rendering and sending of plots.
+        extern latency_histogram plot_render;
+
+        // Number of "?=" requests that are currently queued.
+        extern std::atomic<int64_t> eval_queue_depth;
+
+        // Traffic per message name. Counters for a name are created on first use, and are never removed.
+        void count_received(const char* name, size_t bytes);
+        void count_sent(const char* name, size_t bytes);
+
+        // Keeps track of the plot history size of a graphics device for as long as it exists.
+        class plot_history_counter {
+        public:
+            explicit plot_history_counter(const std::string& device_id);
+            ~plot_history_counter();
+
+            void set(size_t plot_count);
+
+        private:
+            int _slot;
+
+            plot_history_counter(const plot_history_counter&) = delete;
+            plot_history_counter& operator=(const plot_history_counter&) = delete;
+        };
+
+        // Writes a snapshot of all metrics as a single object. Never blocks on R, or on locks held by other threads.
+        void write_stats(json::writer& writer);
+    }
+}
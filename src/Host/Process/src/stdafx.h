@@ -27,6 +27,7 @@
 #define NOMINMAX
 #endif
 
+#include <algorithm>
 #include <atomic>
 #include <cstdarg>
 #include <cinttypes>
@@ -36,9 +37,12 @@
 #include <csetjmp>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
 #include <future>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -54,6 +58,7 @@
 #include "boost/algorithm/string.hpp"
 #include "boost/date_time/posix_time/posix_time.hpp"
 #include "boost/endian/buffers.hpp"
+#include "boost/endian/conversion.hpp"
 #include "boost/format.hpp"
 #include "boost/program_options/cmdline.hpp"
 #include "boost/program_options/options_description.hpp"
@@ -63,6 +68,7 @@
 #include "boost/optional.hpp"
 #include "boost/locale.hpp"
 #include "boost/signals2/signal.hpp"
+#include "boost/utility/string_view.hpp"
 #include "boost/uuid/uuid.hpp"
 #include "boost/uuid/uuid_io.hpp"
 #include "boost/uuid/uuid_generators.hpp"
@@ -85,6 +91,11 @@
 #pragma warning Unknown DLL import/export.
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RHOST_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
@@ -102,7 +113,16 @@
 #else // linux
 #include <unistd.h>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #endif
 
 namespace fs = boost::filesystem;
@@ -21,9 +21,11 @@
  * ***************************************************************************/
 
 #include "blobs.h"
+#include "stats.h"
 #include "transport.h"
 
 using namespace rhost::protocol;
+using namespace rhost::log;
 
 namespace rhost {
     namespace transport {
@@ -36,11 +38,63 @@ namespace rhost {
             const char devNull[] = "/dev/null";
 #endif
 
+            // Outgoing messages are queued and written out by a dedicated thread, so that callers (most
+            // importantly, the R thread producing console output) never block on pipe writes. Whatever
+            // accumulates in the queue while a batch is being written is picked up as the next batch,
+            // and the whole batch goes through a single buffered stream followed by one flush. Thus the
+            // latency of any message is bounded by the time it takes to write out the preceding batch.
+            const size_t output_buffer_size = 0x10000;
+
+            // If the client doesn't keep up, senders are throttled once this many bytes are queued.
+            const size_t max_queued_bytes = 0x4000000;
+
+            // How long to wait for queued messages to be written out on shutdown.
+            const auto flush_timeout = std::chrono::seconds(5);
+
+            // When shared blobs are enabled, blobs of at least shared_blob_threshold bytes are not sent inline,
+            // but placed into a named shared memory region, and the frame only carries the name of that region
+            // in place of the blob. Such frames are marked by shared_blob_flag in the size prefix. Ownership
+            // of the region passes to the receiver, which unlinks it as soon as it is opened. The same applies
+            // in the other direction - the client can use shared blobs for incoming messages.
+            //
+            // While shared blobs are enabled, inline frames can't be shared_blob_flag bytes or larger in either
+            // direction, since the size prefix of such a frame would be indistinguishable from a shared one.
+            const uint32_t shared_blob_flag = 0x80000000;
+            size_t shared_blob_threshold;
+#ifndef _WIN32
+            std::atomic<unsigned> last_shared_blob_id;
+
+            // Regions that were sent, but that the client may not have opened (and thereby unlinked) yet. Should
+            // the client go away without reading them, they'd stay around until reboot, so whatever is left here
+            // is unlinked on disconnect and on exit. Names that the client has already unlinked are pruned from
+            // time to time, so that the list only grows as large as the backlog of unread regions.
+            std::mutex unopened_shared_blobs_lock;
+            std::vector<std::string> unopened_shared_blobs;
+            size_t unopened_shared_blobs_prune_size = 64;
+#endif
+
             std::atomic<bool> connected;
             FILE *input, *output;
-            std::mutex output_lock;
 
-            void log_message(const char* prefix, message_id id, message_id request_id, const char* name, const char* json, const blobs::blob& blob) {
+            std::mutex output_lock;
+            std::condition_variable output_queued, output_written;
+            std::vector<message> output_queue;
+            size_t output_queued_bytes;
+            bool is_writing_output;
+
+            // Console output (both from R and from anything writing to stdout/stderr directly) is not sent
+            // right away, but accumulated here, so that a burst of small writes becomes a single message.
+            // Accumulated output is sent once it has been pending for console_flush_interval, or once it
+            // grows to console_flush_size bytes; and also before any other message, or output for the other
+            // stream, is queued - so relative ordering of all messages is exactly the same as it would be
+            // without coalescing. In particular, all output is flushed before a ReadConsole prompt.
+            std::chrono::milliseconds console_flush_interval;
+            size_t console_flush_size;
+            std::string pending_output;
+            bool pending_output_is_error;
+            std::chrono::steady_clock::time_point pending_output_since;
+
+            void log_message(const char* prefix, message_id id, message_id request_id, const char* name, const char* json, size_t blob_size) {
 #ifdef TRACE_JSON
                 std::ostringstream str;
                 str << prefix << " #" << id << "# " << name;
@@ -51,43 +105,341 @@ namespace rhost {
 
                 str << " " << json;
 
-                if (!blob.empty()) {
-                    str << " <raw (" << blob.size() << " bytes)>";
+                if (blob_size != 0) {
+                    str << " <raw (" << blob_size << " bytes)>";
                 }
 
                 log::logf(log::log_verbosity::traffic, "%s\n\n", str.str().c_str());
 #endif
             }
 
+#ifndef _WIN32
+            void track_unopened_shared_blob(const std::string& name) {
+                std::lock_guard<std::mutex> lock(unopened_shared_blobs_lock);
+
+                if (unopened_shared_blobs.size() >= unopened_shared_blobs_prune_size) {
+                    auto end = std::remove_if(unopened_shared_blobs.begin(), unopened_shared_blobs.end(), [](const std::string& name) {
+                        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+                        if (fd == -1) {
+                            return errno == ENOENT;
+                        }
+                        close(fd);
+                        return false;
+                    });
+                    unopened_shared_blobs.erase(end, unopened_shared_blobs.end());
+                    unopened_shared_blobs_prune_size = std::max<size_t>(64, unopened_shared_blobs.size() * 2);
+                }
+
+                unopened_shared_blobs.push_back(name);
+            }
+
+            void unlink_unopened_shared_blobs() {
+                std::lock_guard<std::mutex> lock(unopened_shared_blobs_lock);
+                for (const auto& name : unopened_shared_blobs) {
+                    shm_unlink(name.c_str());
+                }
+                unopened_shared_blobs.clear();
+            }
+#endif
+
             void disconnect() {
                 if (connected.exchange(false)) {
+                    // Release any senders that are throttled or waiting for the queue to drain.
+                    {
+                        std::lock_guard<std::mutex> lock(output_lock);
+                    }
+                    output_written.notify_all();
+
+#ifndef _WIN32
+                    // The client won't be reading any more messages, so nothing is going to open these.
+                    unlink_unopened_shared_blobs();
+#endif
+
                     disconnected();
                 }
             }
 
+#ifndef _WIN32
+            bool create_shared_blob(const message& msg, std::string& name) {
+                size_t size = msg.blob_size();
+                char buf[64];
+                snprintf(buf, sizeof buf, "/rhost-%d-%u", int(getpid()), ++last_shared_blob_id);
+
+                int fd = shm_open(buf, O_RDWR | O_CREAT | O_EXCL, 0600);
+                if (fd == -1) {
+                    logf(log_verbosity::minimal, "Failed to create shared memory blob %s: %s\n", buf, strerror(errno));
+                    return false;
+                }
+                SCOPE_WARDEN(close_fd, { close(fd); });
+
+                if (ftruncate(fd, size) == 0) {
+                    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                    if (p != MAP_FAILED) {
+                        char* dest = static_cast<char*>(p);
+                        msg.for_each_blob_segment([&](const char* data, size_t n) {
+                            memcpy(dest, data, n);
+                            dest += n;
+                        });
+                        munmap(p, size);
+                        name = buf;
+                        track_unopened_shared_blob(name);
+                        return true;
+                    }
+                }
+
+                logf(log_verbosity::minimal, "Failed to map shared memory blob %s: %s\n", buf, strerror(errno));
+                shm_unlink(buf);
+                return false;
+            }
+
+            std::shared_ptr<const char> open_shared_blob(const std::string& name, size_t& size) {
+                int fd = shm_open(name.c_str(), O_RDONLY, 0);
+                if (fd == -1) {
+                    fatal_error("Failed to open shared memory blob %s: %s", name.c_str(), strerror(errno));
+                }
+                SCOPE_WARDEN(close_fd, { close(fd); });
+
+                // The region now belongs to us, and will stay around for as long as it's mapped.
+                shm_unlink(name.c_str());
+
+                struct stat st;
+                if (fstat(fd, &st) == -1) {
+                    fatal_error("Failed to get size of shared memory blob %s: %s", name.c_str(), strerror(errno));
+                }
+
+                size = static_cast<size_t>(st.st_size);
+                if (size == 0) {
+                    static const char empty = '\0';
+                    return std::shared_ptr<const char>(&empty, [](const char*) {});
+                }
+
+                void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED) {
+                    fatal_error("Failed to map shared memory blob %s: %s", name.c_str(), strerror(errno));
+                }
+
+                return std::shared_ptr<const char>(static_cast<const char*>(p), [size](const char* p) {
+                    munmap(const_cast<char*>(p), size);
+                });
+            }
+#endif
+
+            void attach_shared_blob(message& msg) {
+#ifdef _WIN32
+                fatal_error("Shared memory blobs are not supported on this platform.");
+#else
+                // An inline frame of shared_blob_flag bytes or more would also end up here, with its size
+                // misread and the rest of the stream out of sync, so make sure that this is actually a name.
+                if (msg.blob_size() == 0 || msg.blob_size() > NAME_MAX || msg.blob_data()[0] != '/' ||
+                    memchr(msg.blob_data(), '\0', msg.blob_size())) {
+                    fatal_error("Malformed shared memory blob name in message #%llu#; inline frames cannot be 2 GB or larger while shared blobs are enabled.", msg.id());
+                }
+
+                std::string name(msg.blob_data(), msg.blob_size());
+                size_t size;
+                auto data = open_shared_blob(name, size);
+                msg.set_external_blob(std::move(data), size);
+#endif
+            }
+
             void receive_worker() {
                 for (;;) {
-                    boost::endian::little_uint32_buf_t msg_size;
-                    if (fread(&msg_size, sizeof msg_size, 1, input) != 1) {
+                    boost::endian::little_uint32_buf_t msg_size_buf;
+                    if (fread(&msg_size_buf, sizeof msg_size_buf, 1, input) != 1) {
                         break;
                     }
 
-                    std::string payload(msg_size.value(), '\0');
+                    uint32_t msg_size = msg_size_buf.value();
+                    bool has_shared_blob = false;
+                    if (shared_blob_threshold != 0 && (msg_size & shared_blob_flag)) {
+                        has_shared_blob = true;
+                        msg_size &= ~shared_blob_flag;
+                    }
+
+                    // The frame is read directly into the buffer that will become the message payload, and
+                    // ownership of that buffer is then transferred to the message, so that payload bytes
+                    // (which can be hundreds of MB for ?WriteBlob) are not copied again until a handler
+                    // consumes them in place.
+                    std::string payload(msg_size, '\0');
                     if (!payload.empty()) {
                         if (fread(&payload[0], payload.size(), 1, input) != 1) {
                             break;
                         }
                     }
 
-                    auto msg = message::parse(payload);
-                    log_message("==>", msg.id(), msg.request_id(), msg.name(), msg.json_text(), msg.blob());
+                    auto msg = message::parse(std::move(payload));
+                    if (has_shared_blob) {
+                        attach_shared_blob(msg);
+                    }
+                    log_message("==>", msg.id(), msg.request_id(), msg.name(), msg.json_text(), msg.blob_size());
+                    stats::count_received(msg.name(), msg.blob_offset() + msg.blob_size());
                     message_received(msg);
                 }
 
                 disconnect();
             }
 
-            void read_stream_to_message(int fdr, const std::string& message_name) {
+            // Must be called with output_lock held.
+            void enqueue_message(message&& msg) {
+                log_message("<==", msg.id(), msg.request_id(), msg.name(), msg.json_text(), msg.blob_size());
+                output_queued_bytes += msg.blob_offset() + msg.blob_size();
+                stats::count_sent(msg.name(), msg.blob_offset() + msg.blob_size());
+                output_queue.push_back(std::move(msg));
+            }
+
+            // Must be called with output_lock held.
+            void flush_console_output() {
+                if (pending_output.empty()) {
+                    return;
+                }
+
+                // Output can be large, so escape it straight into the payload rather than through picojson.
+                message_builder builder(0, pending_output_is_error ? "!!" : "!", pending_output.size() + 4);
+                builder.args(pending_output);
+                pending_output.clear();
+
+                enqueue_message(builder.finish());
+            }
+
+            // Must be called with output_lock held. Blocks while the queue is over capacity.
+            bool wait_for_queue_space(std::unique_lock<std::mutex>& lock) {
+                output_written.wait(lock, [] { return output_queued_bytes < max_queued_bytes || !connected; });
+                return connected;
+            }
+
+            bool write(const char* data, size_t size) {
+                return size == 0 || fwrite(data, size, 1, output) == 1;
+            }
+
+#ifndef _WIN32
+            // Writes all buffers with as few syscalls as possible, retrying after partial writes.
+            bool write_all(int fd, std::vector<iovec>& iov) {
+                size_t i = 0;
+                while (i < iov.size()) {
+                    int count = static_cast<int>(std::min<size_t>(iov.size() - i, IOV_MAX));
+                    ssize_t written = writev(fd, &iov[i], count);
+                    if (written < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        return false;
+                    }
+
+                    size_t n = static_cast<size_t>(written);
+                    for (; i < iov.size() && n >= iov[i].iov_len; ++i) {
+                        n -= iov[i].iov_len;
+                    }
+                    if (n != 0) {
+                        iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + n;
+                        iov[i].iov_len -= n;
+                    }
+                }
+                return true;
+            }
+#endif
+
+            bool write_message(const message& msg) {
+                const char* header = msg.payload().data();
+                size_t header_size = msg.blob_offset();
+                size_t blob_size = msg.blob_size();
+
+#ifndef _WIN32
+                std::string shared_blob_name;
+                if (shared_blob_threshold != 0 && blob_size >= shared_blob_threshold) {
+                    // If the region can't be created for whatever reason, just send the blob inline - unless
+                    // it's too large for that.
+                    if (create_shared_blob(msg, shared_blob_name)) {
+                        boost::endian::little_uint32_buf_t msg_size(static_cast<uint32_t>(header_size + shared_blob_name.size()) | shared_blob_flag);
+                        return
+                            write(reinterpret_cast<const char*>(&msg_size), sizeof msg_size) &&
+                            write(header, header_size) &&
+                            write(shared_blob_name.data(), shared_blob_name.size());
+                    }
+
+                    if (header_size + blob_size >= shared_blob_flag) {
+                        fatal_error("Failed to create shared memory blob for message #%llu#, and it is too large to be sent inline.", msg.id());
+                    }
+                }
+#endif
+
+                boost::endian::little_uint32_buf_t msg_size(static_cast<uint32_t>(header_size + blob_size));
+
+#ifndef _WIN32
+                // Large blobs bypass the stdio buffer, and are written straight from where they are (usually
+                // chunks of the blob store), together with the header, in a single gather write. Whatever is
+                // buffered from preceding messages has to go out first.
+                if (blob_size >= output_buffer_size) {
+                    if (fflush(output) != 0) {
+                        return false;
+                    }
+
+                    std::vector<iovec> iov;
+                    iov.push_back({ &msg_size, sizeof msg_size });
+                    iov.push_back({ const_cast<char*>(header), header_size });
+                    msg.for_each_blob_segment([&](const char* data, size_t size) {
+                        iov.push_back({ const_cast<char*>(data), size });
+                    });
+                    return write_all(fileno(output), iov);
+                }
+#endif
+
+                bool ok =
+                    write(reinterpret_cast<const char*>(&msg_size), sizeof msg_size) &&
+                    write(header, header_size);
+                msg.for_each_blob_segment([&](const char* data, size_t size) {
+                    ok = ok && write(data, size);
+                });
+                return ok;
+            }
+
+            void send_worker() {
+                std::vector<message> batch;
+                for (;;) {
+                    {
+                        std::unique_lock<std::mutex> lock(output_lock);
+                        while (output_queue.empty()) {
+                            if (pending_output.empty()) {
+                                output_queued.wait(lock);
+                            } else {
+                                auto deadline = pending_output_since + console_flush_interval;
+                                if (std::chrono::steady_clock::now() >= deadline) {
+                                    flush_console_output();
+                                } else {
+                                    output_queued.wait_until(lock, deadline);
+                                }
+                            }
+                        }
+
+                        batch.swap(output_queue);
+                        output_queued_bytes = 0;
+                        is_writing_output = true;
+                    }
+                    output_written.notify_all();
+
+                    bool ok = connected;
+                    for (auto& msg : batch) {
+                        if (!ok || !(ok = write_message(msg))) {
+                            break;
+                        }
+                    }
+                    if (ok) {
+                        ok = fflush(output) == 0;
+                    }
+                    batch.clear();
+
+                    {
+                        std::lock_guard<std::mutex> lock(output_lock);
+                        is_writing_output = false;
+                    }
+                    output_written.notify_all();
+
+                    if (!ok) {
+                        disconnect();
+                    }
+                }
+            }
+
+            void read_stream_to_message(int fdr, bool is_error) {
                 char line[pipeSize];
                 size_t len = pipeSize;
                 ssize_t nread;
@@ -104,10 +456,7 @@ namespace rhost {
                     }
 
                     if (nread > 0) {
-                        picojson::array json;
-                        json.push_back(picojson::value(std::string(line, nread)));
-                        message msg(0, message_name, json, blobs::blob());
-                        send_message(msg);
+                        send_console_output(is_error, line, nread);
                     }
                 }
             }
@@ -129,22 +478,33 @@ namespace rhost {
                 dup2(stderr_fd[1], fileno(stderr));
 
                 std::thread([stdout_fd]() {
-                    read_stream_to_message(stdout_fd[0], "!");
+                    read_stream_to_message(stdout_fd[0], false);
                 }).detach();
 
                 std::thread([stderr_fd]() {
-                    read_stream_to_message(stderr_fd[0], "!!");
+                    read_stream_to_message(stderr_fd[0], true);
                 }).detach();
             }
         }
 
-        boost::signals2::signal<void(const protocol::message&)> message_received;
+        boost::signals2::signal<void(protocol::message&)> message_received;
 
         boost::signals2::signal<void()> disconnected;
 
-        void initialize() {
+        void initialize(std::chrono::milliseconds console_flush_interval, size_t console_flush_size, size_t shared_blob_threshold) {
             assert(!input && !output);
 
+#ifdef _WIN32
+            if (shared_blob_threshold != 0) {
+                logf(log_verbosity::minimal, "Shared memory blobs are not supported on this platform; sending all blobs inline.\n");
+                shared_blob_threshold = 0;
+            }
+#endif
+            transport::shared_blob_threshold = shared_blob_threshold;
+
+            transport::console_flush_interval = console_flush_interval;
+            transport::console_flush_size = console_flush_size;
+
 #ifdef _WIN32
             setmode(fileno(stdin), _O_BINARY);
             setmode(fileno(stdout), _O_BINARY);
@@ -154,8 +514,9 @@ namespace rhost {
             input = fdopen(dup(fileno(stdin)), "rb");
             setvbuf(input, NULL, _IONBF, 0);
 
+            // Output is fully buffered, and explicitly flushed by send_worker after every batch.
             output = fdopen(dup(fileno(stdout)), "wb");
-            setvbuf(output, NULL, _IONBF, 0);
+            setvbuf(output, NULL, _IOFBF, output_buffer_size);
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-result"
@@ -169,29 +530,83 @@ namespace rhost {
 
             connected = true;
             std::thread(receive_worker).detach();
+            std::thread(send_worker).detach();
+
+#ifndef _WIN32
+            // Handlers run in reverse order of registration, so this runs after the final flush below.
+            std::atexit(unlink_unopened_shared_blobs);
+#endif
+
+            // Give any messages queued just before exit (e.g. "!End") a chance to reach the client.
+            std::atexit(flush);
         }
 
-        void send_message(const message& msg) {
+        void send_message(message&& msg) {
             assert(output);
 
-            log_message("<==", msg.id(), msg.request_id(), msg.name(), msg.json_text(), msg.blob());
-
             if (!connected) {
                 return;
             }
 
-            auto& payload = msg.payload();
-            boost::endian::little_uint32_buf_t msg_size(static_cast<uint32_t>(payload.size()));
+            {
+                std::unique_lock<std::mutex> lock(output_lock);
+                if (!wait_for_queue_space(lock)) {
+                    return;
+                }
+
+                flush_console_output();
+                enqueue_message(std::move(msg));
+            }
+            output_queued.notify_one();
+        }
+
+        void send_console_output(bool is_error, const char* buf, size_t len) {
+            assert(output);
+
+            if (!connected || len == 0) {
+                return;
+            }
 
-            std::lock_guard<std::mutex> lock(output_lock);
-            if (fwrite(&msg_size, sizeof msg_size, 1, output) == 1) {
-                if (fwrite(payload.data(), payload.size(), 1, output) == 1) {
-                    fflush(output);
+            // The writer thread only needs to be woken up if there's a new message in the queue, or if
+            // it needs to start keeping track of a new flush deadline - not for every appended chunk.
+            bool wake_writer = false;
+            {
+                std::unique_lock<std::mutex> lock(output_lock);
+                if (!wait_for_queue_space(lock)) {
                     return;
                 }
+
+                if (!pending_output.empty() && pending_output_is_error != is_error) {
+                    flush_console_output();
+                }
+
+                if (pending_output.empty()) {
+                    pending_output_is_error = is_error;
+                    pending_output_since = std::chrono::steady_clock::now();
+                    wake_writer = true;
+                }
+                pending_output.append(buf, len);
+
+                if (pending_output.size() >= console_flush_size || console_flush_interval.count() <= 0) {
+                    flush_console_output();
+                }
+
+                wake_writer = wake_writer || !output_queue.empty();
             }
 
-            disconnect();
+            if (wake_writer) {
+                output_queued.notify_one();
+            }
+        }
+
+        void flush() {
+            std::unique_lock<std::mutex> lock(output_lock);
+            flush_console_output();
+            output_queued.notify_one();
+
+            output_written.wait_for(lock, flush_timeout, [] {
+                return (output_queue.empty() && !is_writing_output) || !connected;
+            });
         }
 
         bool is_connected() {
@@ -26,13 +26,35 @@
 
 namespace rhost {
     namespace transport {
-        extern boost::signals2::signal<void(const protocol::message&)> message_received;
+        // Handlers may move the message out of the argument if they need to retain it past the call.
+        extern boost::signals2::signal<void(protocol::message&)> message_received;
 
         extern boost::signals2::signal<void()> disconnected;
 
-        void initialize();
+        // Console output is coalesced until it has been pending for console_flush_interval, or has grown
+        // to console_flush_size bytes, whichever comes first. Zero interval disables coalescing.
+        //
+        // If shared_blob_threshold is non-zero, blobs of that size or larger are exchanged via shared memory
+        // regions instead of being sent inline through the pipe. Zero disables shared blobs.
+        void initialize(std::chrono::milliseconds console_flush_interval, size_t console_flush_size, size_t shared_blob_threshold);
 
-        void send_message(const protocol::message& msg);
+        // Queues the message to be sent to the client, and returns without waiting for it to be written.
+        void send_message(protocol::message&& msg);
+
+        inline void send_message(const protocol::message& msg) {
+            send_message(protocol::message(msg));
+        }
+
+        // Queues UTF-8 console output for the "!" (or "!!", if is_error) notification. Adjacent output for
+        // the same stream is merged into a single notification, preserving order wrt all other messages.
+        void send_console_output(bool is_error, const char* buf, size_t len);
+
+        inline void send_console_output(bool is_error, const std::string& s) {
+            send_console_output(is_error, s.data(), s.size());
+        }
+
+        // Blocks until all previously queued messages are written out, or the client disconnects.
+        void flush();
 
         bool is_connected();
     }
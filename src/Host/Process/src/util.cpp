@@ -91,9 +91,9 @@ namespace rhost {
             return boost::locale::conv::utf_to_utf<char>(ws);
         }
 
-        std::string from_utf8(const std::string& u8s) {
+        std::string from_utf8(boost::string_view u8s) {
             // Convert UTF-8 string that is coming from the host to Unicode.
-            auto ws = boost::locale::conv::utf_to_utf<wchar_t>(u8s);
+            auto ws = boost::locale::conv::utf_to_utf<wchar_t>(u8s.data(), u8s.data() + u8s.size());
 
             // Now convert to MBCS. Do it manually since WideCharToMultiByte
             // requires specific code page and fails if character
@@ -136,6 +136,121 @@ namespace rhost {
         }
 #endif
 
+        void arena::reset() {
+            _retired.clear();
+            if (_block) {
+                _capacity = _block_size;
+                _pos = _block.get();
+                _end = _pos + _block_size;
+            } else {
+                _capacity = 0;
+                _pos = _initial;
+                _end = _initial + _initial_size;
+            }
+        }
+
+        void* arena::allocate_block(size_t size, size_t align) {
+            // Allocations that would take up a sizable part of a block get one to themselves, so that the
+            // rest of the current block is not wasted.
+            if (size + align > _block_size / 4) {
+                _retired.emplace_back(new char[size + align]);
+                _capacity += size + align;
+                return align_up(_retired.back().get(), align);
+            }
+
+            if (_block) {
+                _retired.push_back(std::move(_block));
+            }
+            _block.reset(new char[_block_size]);
+            _capacity += _block_size;
+
+            char* p = align_up(_block.get(), align);
+            _pos = p + size;
+            _end = _block.get() + _block_size;
+            return p;
+        }
+
+        namespace sexp_registry {
+            namespace {
+                const R_xlen_t initial_slot_count = 256;
+
+                struct registry {
+                    // VECSXP holding the protected objects; it is itself protected with R_PreserveObject.
+                    SEXP slots = nullptr;
+                    std::vector<R_xlen_t> free_slots;
+                };
+
+                // Never destroyed, so that protected_sexp objects with static storage duration can still
+                // release their slots during exit, regardless of destruction order.
+                registry& get_registry() {
+                    static registry* r = new registry();
+                    return *r;
+                }
+
+                void grow(registry& r) {
+                    R_xlen_t old_count = r.slots ? Rf_xlength(r.slots) : 0;
+                    R_xlen_t new_count = old_count ? old_count * 2 : initial_slot_count;
+
+                    SEXP slots = Rf_protect(Rf_allocVector(VECSXP, new_count));
+                    for (R_xlen_t i = 0; i < old_count; ++i) {
+                        SET_VECTOR_ELT(slots, i, VECTOR_ELT(r.slots, i));
+                    }
+                    R_PreserveObject(slots);
+                    Rf_unprotect(1);
+
+                    if (r.slots) {
+                        R_ReleaseObject(r.slots);
+                    }
+                    r.slots = slots;
+
+                    // Hand out lower slots first.
+                    for (R_xlen_t i = new_count; i > old_count; --i) {
+                        r.free_slots.push_back(i - 1);
+                    }
+                }
+            }
+
+            R_xlen_t protect(SEXP sexp) {
+                auto& r = get_registry();
+                if (r.free_slots.empty()) {
+                    // Growing allocates, so sexp must be protected until it's in a slot.
+                    Rf_protect(sexp);
+                    grow(r);
+                    Rf_unprotect(1);
+                }
+
+                R_xlen_t slot = r.free_slots.back();
+                r.free_slots.pop_back();
+                SET_VECTOR_ELT(r.slots, slot, sexp);
+                return slot;
+            }
+
+            void release(R_xlen_t slot) {
+                auto& r = get_registry();
+                SET_VECTOR_ELT(r.slots, slot, R_NilValue);
+                r.free_slots.push_back(slot);
+            }
+        }
+
+        double get_thread_cpu_time_ms() {
+#ifdef _WIN32
+            FILETIME creation_time, exit_time, kernel_time, user_time;
+            if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+                return 0;
+            }
+
+            auto to_100ns = [](const FILETIME& ft) { return (uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime; };
+            return (to_100ns(kernel_time) + to_100ns(user_time)) / 1e4;
+#else
+            timespec ts;
+            if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+                return 0;
+            }
+
+            return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#endif
+        }
+
         fs::path path_from_string_elt(SEXP string_elt) {
 #ifdef _WIN32
             return fs::path(Rf_wtransChar(string_elt));
@@ -72,35 +72,36 @@ namespace rhost {
         };
 
 
-        struct SEXP_delete {
-            typedef SEXP pointer;
-
-            void operator() (SEXP sexp) {
-                if (sexp) {
-                    R_ReleaseObject(sexp);
-                }
-            }
-        };
+        // Protects R objects from garbage collection for as long as the host references them. Rather than putting
+        // every object on R's precious list with R_PreserveObject - where R_ReleaseObject is a linear scan of the
+        // list - objects are stored in the slots of a host-owned VECSXP, and free slots are kept on a free list,
+        // so that both protecting and releasing an object are O(1). Must only be used on the R thread.
+        namespace sexp_registry {
+            // Stores sexp in a free slot, and returns the index of that slot.
+            R_xlen_t protect(SEXP sexp);
+
+            // Frees the slot, so that the object stored in it is no longer protected by it.
+            void release(R_xlen_t slot);
+        }
 
-        class protected_sexp : public std::unique_ptr<SEXP, SEXP_delete> {
+        class protected_sexp {
         public:
-            using unique_ptr::unique_ptr;
-
             protected_sexp() {}
 
-            protected_sexp(SEXP other) :
-                unique_ptr(other)
-            {
-                R_PreserveObject(other);
+            protected_sexp(SEXP sexp) :
+                _sexp(sexp), _slot(sexp ? sexp_registry::protect(sexp) : -1) {
             }
 
             protected_sexp(const protected_sexp& other) :
                 protected_sexp(other.get()) {}
 
-            protected_sexp(protected_sexp&& other) :
-                unique_ptr(std::move(other)) {}
+            protected_sexp(protected_sexp&& other) {
+                swap(other);
+            }
 
-            using unique_ptr::operator=;
+            ~protected_sexp() {
+                release();
+            }
 
             protected_sexp& operator= (SEXP other) {
                 protected_sexp o(other);
@@ -116,6 +117,148 @@ namespace rhost {
                 swap(other);
                 return *this;
             }
+
+            SEXP get() const {
+                return _sexp;
+            }
+
+            explicit operator bool() const {
+                return _sexp != nullptr;
+            }
+
+            // Protects the new object before releasing the old one, so it's safe to reset to the same object.
+            void reset(SEXP sexp = nullptr) {
+                *this = sexp;
+            }
+
+            // Stops protecting the object, and returns it.
+            SEXP release() {
+                SEXP sexp = _sexp;
+                if (_slot >= 0) {
+                    sexp_registry::release(_slot);
+                }
+                _sexp = nullptr;
+                _slot = -1;
+                return sexp;
+            }
+
+            void swap(protected_sexp& other) {
+                std::swap(_sexp, other._sexp);
+                std::swap(_slot, other._slot);
+            }
+
+        private:
+            SEXP _sexp = nullptr;
+            R_xlen_t _slot = -1;
+        };
+
+        // Bump allocator for data that is all released at once, when the arena is destroyed or reset. Small
+        // allocations are carved out of blocks of block_size bytes; larger ones get a block of their own.
+        // Destructors of objects placed in the arena are not run.
+        class arena {
+        public:
+            explicit arena(size_t block_size = 4096) :
+                _block_size(block_size) {
+            }
+
+            // Allocations are served from the initial buffer until it runs out, and only then from the heap, so
+            // an arena that never outgrows the buffer does not allocate at all. The buffer must outlive the arena,
+            // and the arena must not be moved while it is in use.
+            arena(void* initial, size_t initial_size, size_t block_size = 4096) :
+                _block_size(block_size),
+                _initial(static_cast<char*>(initial)), _initial_size(initial_size),
+                _pos(_initial), _end(_initial + initial_size) {
+            }
+
+            arena(arena&&) = default;
+            arena& operator=(arena&&) = default;
+
+            void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+                char* p = align_up(_pos, align);
+                if (!_pos || size > static_cast<size_t>(_end - p)) {
+                    return allocate_block(size, align);
+                }
+                _pos = p + size;
+                return p;
+            }
+
+            char* allocate_chars(size_t size) {
+                return static_cast<char*>(allocate(size, 1));
+            }
+
+            // Releases everything allocated so far, but keeps the current block for reuse.
+            void reset();
+
+            // Total size of all heap blocks currently held.
+            size_t capacity() const {
+                return _capacity;
+            }
+
+        private:
+            size_t _block_size;
+            char* _initial = nullptr;
+            size_t _initial_size = 0;
+            std::unique_ptr<char[]> _block; // the one that allocations are currently carved from, once there is one
+            std::vector<std::unique_ptr<char[]>> _retired; // filled blocks, and blocks for large allocations
+            char* _pos = nullptr;
+            char* _end = nullptr;
+            size_t _capacity = 0;
+
+            static char* align_up(char* p, size_t align) {
+                return p + (align - reinterpret_cast<uintptr_t>(p) % align) % align;
+            }
+
+            void* allocate_block(size_t size, size_t align);
+
+            arena(const arena&) = delete;
+            arena& operator=(const arena&) = delete;
+        };
+
+        // Standard allocator that allocates from an arena, or from the heap if there is none. Deallocation from
+        // an arena is a no-op, and memory is reclaimed when the arena is reset or destroyed. Serves the same
+        // purpose as std::pmr::polymorphic_allocator with a monotonic_buffer_resource, which C++14 lacks.
+        template <class T>
+        class arena_allocator {
+        public:
+            typedef T value_type;
+
+            arena_allocator(arena* arena = nullptr) noexcept :
+                _arena(arena) {
+            }
+
+            template <class U>
+            arena_allocator(const arena_allocator<U>& other) noexcept :
+                _arena(other._arena) {
+            }
+
+            T* allocate(size_t n) {
+                if (_arena) {
+                    return static_cast<T*>(_arena->allocate(n * sizeof(T), alignof(T)));
+                }
+                return static_cast<T*>(::operator new(n * sizeof(T)));
+            }
+
+            void deallocate(T* p, size_t) noexcept {
+                if (!_arena) {
+                    ::operator delete(p);
+                }
+            }
+
+            template <class U>
+            bool operator==(const arena_allocator<U>& other) const noexcept {
+                return _arena == other._arena;
+            }
+
+            template <class U>
+            bool operator!=(const arena_allocator<U>& other) const noexcept {
+                return _arena != other._arena;
+            }
+
+        private:
+            template <class U>
+            friend class arena_allocator;
+
+            arena* _arena;
         };
 
 #ifdef _WIN32
@@ -124,7 +267,7 @@ namespace rhost {
         inline std::string Rchar_to_utf8(const std::string& s) {
             return Rchar_to_utf8(s.data(), s.size());
         }
-        std::string from_utf8(const std::string& u8s);
+        std::string from_utf8(boost::string_view u8s);
 #else
         inline std::string Rchar_to_utf8(const char* buf, size_t len) {
             return std::string(buf, len);
@@ -134,8 +277,8 @@ namespace rhost {
             return s;
         }
 
-        inline std::string from_utf8(const std::string& u8s){
-            return u8s;
+        inline std::string from_utf8(boost::string_view u8s){
+            return std::string(u8s.data(), u8s.size());
         }
 #endif
 
@@ -147,19 +290,8 @@ namespace rhost {
 
         fs::path path_from_string_elt(SEXP string_elt);
 
-        inline void append(picojson::array& msg) {
-        }
-
-        template<class Arg>
-        inline void append(picojson::array& msg, Arg&& arg) {
-            msg.push_back(picojson::value(std::forward<Arg>(arg)));
-        }
-
-        template<class Arg, class... Args>
-        inline void append(picojson::array& msg, Arg&& arg, Args&&... args) {
-            msg.push_back(picojson::value(std::forward<Arg>(arg)));
-            append(msg, std::forward<Args>(args)...);
-        }
+        // CPU time (user and kernel) consumed by the calling thread so far, in milliseconds.
+        double get_thread_cpu_time_ms();
 
         // A C++-friendly helper for Rf_error. Invoking Rf_error directly is not a good idea, because
         // it performs a longjmp, which will skip all C++ destructors when unwinding stack frames - so
@@ -0,0 +1,143 @@
+/* ****************************************************************************
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ *
+ *
+ * This file is part of Microsoft R Host.
+ *
+ * Microsoft R Host is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Microsoft R Host is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Microsoft R Host.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ***************************************************************************/
+
+// Checks that dtoa::format_shortest output parses back to exactly the same double. The corpus covers the
+// boundaries of the double range, subnormals, powers of ten and of two along with their neighbours, decimal
+// fractions, and numbers that are known to be hard for shortest-digit algorithms; it's followed by a sweep
+// of random bit patterns from a fixed seed, so that failures are reproducible.
+
+#include "dtoa.h"
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+namespace {
+    using namespace rhost;
+
+    size_t failures = 0;
+    size_t checked = 0;
+
+    double from_bits(uint64_t bits) {
+        double value;
+        memcpy(&value, &bits, sizeof value);
+        return value;
+    }
+
+    uint64_t to_bits(double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof bits);
+        return bits;
+    }
+
+    void check(double value) {
+        if (!std::isfinite(value)) {
+            return;
+        }
+        ++checked;
+
+        char buf[dtoa::max_length + 1];
+        char* end = dtoa::format_shortest(value, buf);
+        size_t length = end - buf;
+        if (length > dtoa::max_length) {
+            printf("FAIL: %a formatted to %zu characters\n", value, length);
+            ++failures;
+            return;
+        }
+        *end = '\0';
+
+        char* parse_end;
+        double parsed = strtod(buf, &parse_end);
+        if (parse_end != end || to_bits(parsed) != to_bits(value)) {
+            printf("FAIL: %a (%.17g) formatted as \"%s\", which parses as %a\n", value, value, buf, parsed);
+            ++failures;
+        }
+    }
+
+    // Value itself, and the doubles immediately below and above it.
+    void check_with_neighbours(double value) {
+        check(value);
+        check(std::nextafter(value, -INFINITY));
+        check(std::nextafter(value, INFINITY));
+        check(-value);
+    }
+
+    void check_corpus() {
+        const double edges[] = {
+            0.0, -0.0,
+            DBL_MIN, DBL_MAX, DBL_EPSILON,
+            5e-324, 1e-323, 2.2250738585072009e-308, 2.2250738585072014e-308,
+            1e23, 9.999999999999999e22, 8.41e21, 5.0e-324, 1.7976931348623157e308,
+            0.1, 0.2, 0.3, 0.7, 1.1, 2.675, 1.005, 0.1 + 0.2, 1.0 / 3, 2.0 / 3,
+            123456789012345678.0, 9007199254740991.0, 9007199254740992.0, 9007199254740993.0,
+            4.35, 0.000001, 1e-5, 1e-4, 1e15, 1e16, 1e21, 1e22,
+            299792458.0, 6.02214076e23, 1.602176634e-19, 3.141592653589793, 2.718281828459045,
+            9.5367431640625e-7, 1.4901161193847656e-8, 5e-310, 4.9406564584124654e-324,
+        };
+        for (double value : edges) {
+            check_with_neighbours(value);
+        }
+
+        for (int exponent = -324; exponent <= 308; ++exponent) {
+            check_with_neighbours(std::pow(10.0, exponent));
+            check_with_neighbours(strtod(("1e" + std::to_string(exponent)).c_str(), nullptr));
+        }
+
+        for (int exponent = -1074; exponent <= 1023; ++exponent) {
+            check_with_neighbours(std::ldexp(1.0, exponent));
+        }
+
+        // Decimal fractions with up to 4 digits after the point.
+        for (int i = 0; i <= 100000; ++i) {
+            check(i / 10000.0);
+            check(strtod((std::to_string(i / 10000) + "." + std::to_string(10000 + i % 10000).substr(1)).c_str(), nullptr));
+        }
+
+        // Subnormals: the smallest ones, and the largest ones below DBL_MIN.
+        for (uint64_t bits = 1; bits < 100000; ++bits) {
+            check(from_bits(bits));
+            check(from_bits(0x000FFFFFFFFFFFFFULL - bits));
+        }
+
+        // Same significand under every exponent.
+        for (uint64_t exponent = 0; exponent < 0x7FF; ++exponent) {
+            check(from_bits((exponent << 52) | 0x0000000000000001ULL));
+            check(from_bits((exponent << 52) | 0x000FFFFFFFFFFFFFULL));
+            check(from_bits((exponent << 52) | 0x0008000000000000ULL));
+        }
+    }
+
+    void check_random_bit_patterns(size_t count) {
+        std::mt19937_64 rng(20160901);
+        for (size_t i = 0; i < count; ++i) {
+            check(from_bits(rng()));
+        }
+    }
+}
+
+int main() {
+    check_corpus();
+    check_random_bit_patterns(2000000);
+
+    printf("%zu values checked, %zu failed\n", checked, failures);
+    return failures == 0 ? 0 : 1;
+}